@@ -1,11 +1,31 @@
+#define _GNU_SOURCE // accept4, O_DIRECT
+
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#endif
+
 struct InputBuffer_t {
   char* buffer;
   size_t buffer_length;
@@ -47,16 +67,12 @@ void read_input(InputBuffer* input_buffer) {
 #define COLUMN_EMAIL_SIZE 255
 
 struct Row_t {
-  uint32_t id;
+  uint64_t id;
   char username[COLUMN_USERNAME_SIZE + 1];
   char email[COLUMN_EMAIL_SIZE + 1];
 };
 typedef struct Row_t Row;
 
-void print_row(Row* row) {
-  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
-}
-
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
@@ -73,10 +89,245 @@ void seriarize_row(Row* src, void* dest) {
   memcpy(dest + EMAIL_OFFSET, &(src->email), EMAIL_SIZE);
 }
 
-void deseriarize_row(void* src, Row* dest) {
-  memcpy(&(dest->id), src + ID_OFFSET, ID_SIZE);
-  memcpy(&(dest->username), src + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(dest->email), src + EMAIL_OFFSET, EMAIL_SIZE);
+/*
+ * Result Output
+ *
+ * Rows are formatted straight from the page into one large reusable buffer
+ * instead of going through printf one row at a time. With a sink the buffer
+ * is written out in OUTPUT_BUFFER_SIZE chunks; without one (server mode) it
+ * starts empty, grows to hold the whole response, and is released again by
+ * output_reset() if a large response grew it past OUTPUT_BUFFER_SIZE.
+ */
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+#define OUTPUT_MIN_BUFFER_SIZE 4096
+
+enum OutputMode_t {
+  OUTPUT_MODE_TEXT,
+  OUTPUT_MODE_CSV,
+  OUTPUT_MODE_TSV,
+  OUTPUT_MODE_BINARY,
+};
+typedef enum OutputMode_t OutputMode;
+
+const char* OUTPUT_MODE_NAMES[] = {"text", "csv", "tsv", "binary"};
+
+struct Output_t {
+  FILE* sink;
+  OutputMode mode;
+  char* buffer;
+  size_t length;
+  size_t capacity;
+};
+typedef struct Output_t Output;
+
+Output* new_output(FILE* sink) {
+  Output* output = malloc(sizeof(Output));
+  output->sink = sink;
+  output->mode = OUTPUT_MODE_TEXT;
+  output->length = 0;
+  if (sink != NULL) {
+    output->buffer = malloc(OUTPUT_BUFFER_SIZE);
+    output->capacity = OUTPUT_BUFFER_SIZE;
+  } else {
+    // Allocated on first use, so idle server connections cost nothing
+    output->buffer = NULL;
+    output->capacity = 0;
+  }
+
+  return output;
+}
+
+void close_output(Output* output) {
+  free(output->buffer);
+  free(output);
+}
+
+void output_flush(Output* output) {
+  if (output->sink == NULL || output->length == 0) {
+    return;
+  }
+
+  fwrite(output->buffer, 1, output->length, output->sink);
+  output->length = 0;
+}
+
+/*
+ * Make room for at least length more bytes.
+ */
+void output_reserve(Output* output, size_t length) {
+  if (output->length + length <= output->capacity) {
+    return;
+  }
+
+  output_flush(output);
+  if (output->length + length <= output->capacity) {
+    return;
+  }
+  if (output->capacity == 0) {
+    output->capacity = OUTPUT_MIN_BUFFER_SIZE;
+  }
+  while (output->length + length > output->capacity) {
+    output->capacity *= 2;
+  }
+  output->buffer = realloc(output->buffer, output->capacity);
+}
+
+/*
+ * Discard buffered output before starting a new response.
+ */
+void output_reset(Output* output) {
+  output->length = 0;
+  if (output->sink == NULL && output->capacity > OUTPUT_BUFFER_SIZE) {
+    free(output->buffer);
+    output->buffer = NULL;
+    output->capacity = 0;
+  }
+}
+
+void output_append(Output* output, const void* data, size_t length) {
+  output_reserve(output, length);
+  memcpy(output->buffer + output->length, data, length);
+  output->length += length;
+}
+
+void output_printf(Output* output, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  va_list args_copy;
+  va_copy(args_copy, args);
+  int length = vsnprintf(NULL, 0, format, args_copy);
+  va_end(args_copy);
+
+  output_reserve(output, length + 1);
+  vsnprintf(output->buffer + output->length, length + 1, format, args);
+  output->length += length;
+  va_end(args);
+}
+
+char* write_uint64(char* dest, uint64_t value) {
+  char digits[20];
+  int num_digits = 0;
+  do {
+    digits[num_digits++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+
+  while (num_digits > 0) {
+    *dest++ = digits[--num_digits];
+  }
+  return dest;
+}
+
+char* write_csv_field(char* dest, const char* field, size_t length) {
+  if (strcspn(field, ",\"\r\n") >= length) {
+    memcpy(dest, field, length);
+    return dest + length;
+  }
+
+  *dest++ = '"';
+  for (size_t i = 0; i < length; i++) {
+    if (field[i] == '"') {
+      *dest++ = '"';
+    }
+    *dest++ = field[i];
+  }
+  *dest++ = '"';
+  return dest;
+}
+
+char* write_tsv_field(char* dest, const char* field, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    switch (field[i]) {
+      case '\\':
+        *dest++ = '\\';
+        *dest++ = '\\';
+        break;
+      case '\t':
+        *dest++ = '\\';
+        *dest++ = 't';
+        break;
+      case '\n':
+        *dest++ = '\\';
+        *dest++ = 'n';
+        break;
+      case '\r':
+        *dest++ = '\\';
+        *dest++ = 'r';
+        break;
+      default:
+        *dest++ = field[i];
+    }
+  }
+  return dest;
+}
+
+/*
+ * Append one serialized row (as stored in a leaf cell) in the current mode.
+ *
+ * binary: a 4-byte big-endian length followed by the row exactly as stored
+ * (id in host byte order, then NUL-padded username and email columns). The
+ * rows of a result are followed by a zero length.
+ */
+void output_row(Output* output, void* row) {
+  if (output->mode == OUTPUT_MODE_BINARY) {
+    uint32_t length = htonl(ROW_SIZE);
+    output_reserve(output, sizeof(length) + ROW_SIZE);
+    memcpy(output->buffer + output->length, &length, sizeof(length));
+    memcpy(output->buffer + output->length + sizeof(length), row, ROW_SIZE);
+    output->length += sizeof(length) + ROW_SIZE;
+    return;
+  }
+
+  uint64_t id;
+  memcpy(&id, row + ID_OFFSET, ID_SIZE);
+  const char* username = row + USERNAME_OFFSET;
+  size_t username_length = strnlen(username, USERNAME_SIZE);
+  const char* email = row + EMAIL_OFFSET;
+  size_t email_length = strnlen(email, EMAIL_SIZE);
+
+  // Escaping at most doubles a column, plus quotes and separators
+  output_reserve(output, 20 + 2 * (USERNAME_SIZE + EMAIL_SIZE) + 16);
+  char* dest = output->buffer + output->length;
+  switch (output->mode) {
+    case OUTPUT_MODE_TEXT:
+      *dest++ = '(';
+      dest = write_uint64(dest, id);
+      memcpy(dest, ", ", 2);
+      dest += 2;
+      memcpy(dest, username, username_length);
+      dest += username_length;
+      memcpy(dest, ", ", 2);
+      dest += 2;
+      memcpy(dest, email, email_length);
+      dest += email_length;
+      *dest++ = ')';
+      break;
+    case OUTPUT_MODE_CSV:
+      dest = write_uint64(dest, id);
+      *dest++ = ',';
+      dest = write_csv_field(dest, username, username_length);
+      *dest++ = ',';
+      dest = write_csv_field(dest, email, email_length);
+      break;
+    case OUTPUT_MODE_TSV:
+      dest = write_uint64(dest, id);
+      *dest++ = '\t';
+      dest = write_tsv_field(dest, username, username_length);
+      *dest++ = '\t';
+      dest = write_tsv_field(dest, email, email_length);
+      break;
+    case OUTPUT_MODE_BINARY:
+      break;
+  }
+  *dest++ = '\n';
+  output->length = dest - output->buffer;
+}
+
+void output_end_of_rows(Output* output) {
+  if (output->mode == OUTPUT_MODE_BINARY) {
+    uint32_t length = 0;
+    output_append(output, &length, sizeof(length));
+  }
 }
 
 const uint32_t PAGE_SIZE = 4096;
@@ -114,12 +365,14 @@ bool is_node_root(void* node) {
  */
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE;
 
 /*
  Leaf Node Body Layout
  */
-const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint64_t);
 const uint32_t LEAF_NODE_KEY_OFFSET = 0;
 const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
 const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
@@ -131,6 +384,10 @@ uint32_t* leaf_node_num_cells(void* node) {
   return node + LEAF_NODE_NUM_CELLS_OFFSET;
 }
 
+uint32_t* leaf_node_next_leaf(void* node) {
+  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
 uint8_t* leaf_node_type(void* node) {
   return node + NODE_TYPE_OFFSET;
 }
@@ -139,7 +396,7 @@ void* leaf_node_cell(void* node, uint32_t cell_num) {
   return node + LEAF_NODE_HEADER_SIZE + LEAF_NODE_CELL_SIZE * cell_num;
 }
 
-uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
+uint64_t* leaf_node_key(void* node, uint32_t cell_num) {
   return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_OFFSET;
 }
 
@@ -157,6 +414,7 @@ void set_node_type(void* node, NodeType type) {
 
 void initialize_leaf_node(void* node) {
   *leaf_node_num_cells(node) = 0;
+  *leaf_node_next_leaf(node) = 0; // 0 represents no sibling (page 0 is always the header)
   set_node_type(node, NODE_LEAF);
   set_node_root(node, false);
 }
@@ -173,9 +431,11 @@ const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NO
 /*
  Internal Node Body Layout
  */
-const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint64_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_MAX_CELLS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
 
 uint32_t* internal_node_num_keys(void* node) {
   return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
@@ -185,7 +445,7 @@ uint32_t* internal_node_right_child(void* node) {
   return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
 }
 
-uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
+void* internal_node_cell(void* node, uint32_t cell_num) {
   return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
 }
 
@@ -201,7 +461,7 @@ uint32_t* internal_node_child(void* node, uint32_t child_num) {
   }
 }
 
-uint32_t* internal_node_key(void* node, uint32_t key_num) {
+uint64_t* internal_node_key(void* node, uint32_t key_num) {
   return internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
 }
 
@@ -212,7 +472,7 @@ void initialize_internal_node(void* node) {
   set_node_root(node, false);
 }
 
-uint32_t get_node_max_key(void* node) {
+uint64_t get_node_max_key(void* node) {
   switch (get_node_type(node)) {
     case NODE_INTERNAL:
       return *internal_node_key(node, *internal_node_num_keys(node) - 1);
@@ -222,227 +482,1129 @@ uint32_t get_node_max_key(void* node) {
 }
 
 
-struct Pager_t {
-  int fd;
-  uint32_t file_length;
-  uint32_t num_pages;
-  void* pages[MAX_TABLE_PAGE_NUM];
+/*
+ * Runtime Statistics
+ *
+ * Latencies are recorded into log-linear (HDR-style) histograms: values
+ * below 2 * LATENCY_SUB_BUCKET_COUNT get their own bucket, larger values are
+ * grouped by power of two and split into LATENCY_SUB_BUCKET_COUNT linear
+ * sub-buckets, so every bucket is accurate to within 1 / LATENCY_SUB_BUCKET_COUNT.
+ */
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKET_COUNT (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKET_COUNT ((64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKET_COUNT)
+
+struct LatencyHistogram_t {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[LATENCY_BUCKET_COUNT];
 };
-typedef struct Pager_t Pager;
-
-Pager* pager_open(const char* filename) {
-  int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+typedef struct LatencyHistogram_t LatencyHistogram;
+
+struct Stats_t {
+  uint64_t page_cache_hits;
+  uint64_t page_cache_misses;
+  uint64_t page_reads;
+  uint64_t page_prefetches;
+  uint64_t page_writes;
+  uint64_t syscalls;
+  uint64_t leaf_splits;
+  uint64_t append_splits;
+  uint64_t root_splits;
+  LatencyHistogram insert_latency;
+  LatencyHistogram select_latency;
+};
+typedef struct Stats_t Stats;
+
+// Only the main thread updates these (I/O threads report back through it).
+// The stats dump thread reads them under stats_lock, which the main thread
+// holds except while it waits for input.
+Stats stats;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-  if (fd == -1) {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
+uint32_t latency_bucket_index(uint64_t value) {
+  if (value < 2 * LATENCY_SUB_BUCKET_COUNT) {
+    return value;
   }
 
-  off_t file_length = lseek(fd, 0, SEEK_END);
-
-  Pager* pager = malloc(sizeof(Pager));
-  pager->fd = fd;
-  pager->file_length = file_length;
-  pager->num_pages = file_length / PAGE_SIZE;
+  uint32_t msb = 63 - __builtin_clzll(value);
+  uint32_t shift = msb - LATENCY_SUB_BUCKET_BITS;
+  uint32_t sub_bucket = (value >> shift) & (LATENCY_SUB_BUCKET_COUNT - 1);
+  return (shift + 1) * LATENCY_SUB_BUCKET_COUNT + sub_bucket;
+}
 
-  if (pager->file_length % PAGE_SIZE != 0) {
-    printf("DB file is not a whole number of pages. DB file is corrupted.\n");
-    exit(EXIT_FAILURE);
+/*
+ * Return the largest value that falls into the given bucket.
+ */
+uint64_t latency_bucket_upper_bound(uint32_t index) {
+  if (index < 2 * LATENCY_SUB_BUCKET_COUNT) {
+    return index;
   }
 
-  for (int i = 0; i < MAX_TABLE_PAGE_NUM; i++) {
-    pager->pages[i] = NULL;
-  }
+  uint32_t shift = index / LATENCY_SUB_BUCKET_COUNT - 1;
+  uint64_t sub_bucket = index % LATENCY_SUB_BUCKET_COUNT;
+  return ((LATENCY_SUB_BUCKET_COUNT + sub_bucket + 1) << shift) - 1;
+}
 
-  return pager;
+void latency_histogram_record(LatencyHistogram* histogram, uint64_t value_ns) {
+  histogram->count++;
+  histogram->total_ns += value_ns;
+  if (value_ns > histogram->max_ns) {
+    histogram->max_ns = value_ns;
+  }
+  histogram->buckets[latency_bucket_index(value_ns)]++;
 }
 
-void pager_close(Pager* pager) {
-  int result = close(pager->fd);
-  if (result < 0) {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
+uint64_t latency_histogram_percentile(LatencyHistogram* histogram, double percentile) {
+  uint64_t target = (uint64_t)(histogram->count * percentile / 100.0 + 0.5);
+  if (target == 0) {
+    target = 1;
   }
 
-  for (int i = 0; i < MAX_TABLE_PAGE_NUM; i++) {
-    if (pager->pages[i]) {
-      free(pager->pages[i]);
-      pager->pages[i] = NULL;
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= target) {
+      uint64_t upper_bound = latency_bucket_upper_bound(i);
+      return upper_bound < histogram->max_ns ? upper_bound : histogram->max_ns;
     }
   }
-  free(pager);
+  return histogram->max_ns;
 }
 
-void pager_flush(Pager* pager, uint32_t page_num) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Error: Tried to flush null page\n");
-    exit(EXIT_FAILURE);
+void print_latency_histogram(Output* out, const char* name, LatencyHistogram* histogram) {
+  if (histogram->count == 0) {
+    output_printf(out, "%s: count 0\n", name);
+    return;
   }
 
-  off_t offset = lseek(pager->fd, page_num * PAGE_SIZE, SEEK_SET);
-  if (offset < 0) {
-    printf("Error: failed to seek: %d\n", errno);
-    exit(EXIT_FAILURE);
-  }
+  output_printf(out, "%s: count %" PRIu64 ", mean %.1fus, p50 %.1fus, p90 %.1fus, p99 %.1fus, p999 %.1fus, max %.1fus\n",
+      name,
+      histogram->count,
+      histogram->total_ns / (double)histogram->count / 1000.0,
+      latency_histogram_percentile(histogram, 50) / 1000.0,
+      latency_histogram_percentile(histogram, 90) / 1000.0,
+      latency_histogram_percentile(histogram, 99) / 1000.0,
+      latency_histogram_percentile(histogram, 99.9) / 1000.0,
+      histogram->max_ns / 1000.0);
+}
 
-  ssize_t bytes_written = write(pager->fd, pager->pages[page_num], PAGE_SIZE);
-  if (bytes_written < 0) {
-    printf("Error: flushing page: %d\n", errno);
-    exit(EXIT_FAILURE);
-  }
+void reset_stats() {
+  memset(&stats, 0, sizeof(Stats));
 }
 
-void* get_page(Pager* pager, uint32_t page_num) {
-  if (page_num >= MAX_TABLE_PAGE_NUM) {
-    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, MAX_TABLE_PAGE_NUM);
-    exit(EXIT_FAILURE);
-  }
+/*
+ * Database Header Layout
+ *
+ * Page 0 holds the header; the btree starts at the page it points to.
+ */
+const uint32_t DB_HEADER_PAGE_NUM = 0;
+const uint32_t DB_HEADER_ROOT_PAGE_NUM_SIZE = sizeof(uint32_t);
+const uint32_t DB_HEADER_ROOT_PAGE_NUM_OFFSET = 0;
+const uint32_t DB_HEADER_NEXT_ROW_ID_SIZE = sizeof(uint64_t);
+const uint32_t DB_HEADER_NEXT_ROW_ID_OFFSET = DB_HEADER_ROOT_PAGE_NUM_OFFSET + DB_HEADER_ROOT_PAGE_NUM_SIZE;
+
+uint32_t* db_header_root_page_num(void* header) {
+  return header + DB_HEADER_ROOT_PAGE_NUM_OFFSET;
+}
 
-  if (pager->pages[page_num] == NULL) {
-    // Cache miss
-    void* page = malloc(PAGE_SIZE);
+/*
+ * Always greater than every key in the table, or 0 once the id space is
+ * exhausted.
+ */
+uint64_t* db_header_next_row_id(void* header) {
+  return header + DB_HEADER_NEXT_ROW_ID_OFFSET;
+}
 
-    if (page_num < pager->num_pages) {
-      // page exists in file
-      lseek(pager->fd, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->fd, page, PAGE_SIZE);
-      if (bytes_read < 0) {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
-    } else {
-      // page doesn't exist in file. let's extend page
-      pager->num_pages = page_num + 1;
-    }
+/*
+ * Asynchronous Page I/O
+ *
+ * Reads and writes are queued on an I/O engine and reaped later, so a scan
+ * can keep several leaf reads in flight and a flush can hand every page to
+ * the kernel in one batch. io_uring is used where the kernel provides it;
+ * otherwise a small pool of threads runs blocking pread/pwrite calls.
+ */
+#define IO_QUEUE_DEPTH 64
+#define IO_THREAD_COUNT 4
 
-    pager->pages[page_num] = page;
-  }
+enum IoEngineType_t {
+  IO_ENGINE_URING,
+  IO_ENGINE_THREADS,
+};
+typedef enum IoEngineType_t IoEngineType;
 
-  return pager->pages[page_num];
-}
+enum IoOp_t {
+  IO_OP_READ,
+  IO_OP_WRITE,
+};
+typedef enum IoOp_t IoOp;
 
-struct Table_t {
-  Pager* pager;
-  uint32_t root_page_num;
+struct IoRequest_t {
+  IoOp op;
+  uint32_t page_num;
+  void* buffer;
 };
-typedef struct Table_t Table;
+typedef struct IoRequest_t IoRequest;
 
-Table* db_open(const char* filename) {
-  Pager* pager = pager_open(filename);
+struct IoCompletion_t {
+  uint32_t page_num;
+  ssize_t result; // bytes transferred, or -errno
+};
+typedef struct IoCompletion_t IoCompletion;
+
+#ifdef __linux__
+struct IoUring_t {
+  int ring_fd;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_ring_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_ring_mask;
+  struct io_uring_cqe* cqes;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  uint32_t to_submit;
+  struct iovec iovecs[IO_QUEUE_DEPTH];
+  uint32_t next_iovec;
+};
+typedef struct IoUring_t IoUring;
 
-  Table *table = malloc(sizeof(Table));
-  table->pager = pager;
-  table->root_page_num = 0; // tmp value for implementing single leaf node pattern
+bool io_uring_open(IoUring* ring) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
 
-  if (pager->num_pages == 0) {
-    // New database file. Initialize page 0 as a leaf node.
-    void* root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    set_node_root(root_node, true);
+  int ring_fd = syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &params);
+  if (ring_fd < 0) {
+    return false;
   }
 
-  return table;
-}
-
-void db_close(Table* table) {
-  for (uint32_t i = 0; i < table->pager->num_pages; i++) {
-    // Flush all pages
-    if (table->pager->pages[i] == NULL) {
-      continue;
-    }
-    pager_flush(table->pager, i);
+  ring->ring_fd = ring_fd;
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    close(ring_fd);
+    return false;
   }
 
-  pager_close(table->pager);
-  free(table);
+  ring->sq_head = ring->sq_ring + params.sq_off.head;
+  ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+  ring->sq_ring_mask = ring->sq_ring + params.sq_off.ring_mask;
+  ring->sq_array = ring->sq_ring + params.sq_off.array;
+  ring->cq_head = ring->cq_ring + params.cq_off.head;
+  ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+  ring->cq_ring_mask = ring->cq_ring + params.cq_off.ring_mask;
+  ring->cqes = ring->cq_ring + params.cq_off.cqes;
+  ring->to_submit = 0;
+  ring->next_iovec = 0;
+
+  return true;
 }
 
-struct Cursor_t {
-  Table *table;
-  uint32_t page_num;
-  uint32_t cell_num;
-  bool end_of_table; // Indicates a position one past the last element
-};
-typedef struct Cursor_t Cursor;
+void io_uring_close(IoUring* ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->ring_fd);
+}
 
-Cursor* table_start(Table* table) {
-  Cursor* cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = table->root_page_num;
-  cursor->cell_num = 0;
+/*
+ * Queue a request in the submission ring. Nothing reaches the kernel until
+ * io_uring_enter_ring() is called. The caller keeps at most IO_QUEUE_DEPTH
+ * requests in flight, so there is always a free entry and iovec.
+ */
+void io_uring_queue(IoUring* ring, int fd, IoRequest* request) {
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_ring_mask;
+
+  struct iovec* iov = &ring->iovecs[ring->next_iovec];
+  ring->next_iovec = (ring->next_iovec + 1) % IO_QUEUE_DEPTH;
+  iov->iov_base = request->buffer;
+  iov->iov_len = PAGE_SIZE;
+
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = request->op == IO_OP_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)iov;
+  sqe->len = 1;
+  sqe->off = (uint64_t)request->page_num * PAGE_SIZE;
+  sqe->user_data = request->page_num;
+
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+}
 
-  void* root_node = get_page(table->pager, table->root_page_num);
-  uint32_t root_node_num_cells = *leaf_node_num_cells(root_node);
-  cursor->end_of_table = (root_node_num_cells == 0);
+void io_uring_enter_ring(IoUring* ring, bool wait) {
+  if (ring->to_submit == 0 && !wait) {
+    return;
+  }
 
-  return cursor;
+  while (true) {
+    stats.syscalls++;
+    int submitted = syscall(__NR_io_uring_enter, ring->ring_fd, ring->to_submit, wait ? 1 : 0,
+        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (submitted >= 0) {
+      ring->to_submit -= submitted;
+      return;
+    }
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      printf("Error: io_uring_enter failed: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
 }
 
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  void* node = get_page(table->pager, page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+uint32_t io_uring_reap(IoUring* ring, IoCompletion* completions, uint32_t max_completions) {
+  uint32_t count = 0;
+  unsigned head = *ring->cq_head;
 
-  Cursor* cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = page_num;
+  while (count < max_completions && head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_ring_mask];
+    completions[count].page_num = (uint32_t)cqe->user_data;
+    completions[count].result = cqe->res;
+    count++;
+    head++;
+  }
 
-  // Binary Search
-  uint32_t min_idx = 0;
-  uint32_t one_past_max_idx = num_cells;
-  while (min_idx < one_past_max_idx) {
-    uint32_t mid_idx = min_idx + (one_past_max_idx - min_idx) / 2;
-    uint32_t mid_key = *leaf_node_key(node, mid_idx);
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return count;
+}
+#endif
 
-    if (key == mid_key) {
-      cursor->cell_num = mid_idx;
-      return cursor;
-    }
+struct IoThreadPool_t {
+  int fd;
+  pthread_t threads[IO_THREAD_COUNT];
+  pthread_mutex_t lock;
+  pthread_cond_t request_ready;
+  pthread_cond_t completion_ready;
+  IoRequest requests[IO_QUEUE_DEPTH];
+  uint32_t request_head;
+  uint32_t request_count;
+  IoCompletion completions[IO_QUEUE_DEPTH];
+  uint32_t completion_count;
+  bool shutting_down;
+};
+typedef struct IoThreadPool_t IoThreadPool;
 
-    if (key < mid_key) {
-      one_past_max_idx = mid_idx;
+ssize_t io_thread_transfer(int fd, IoRequest* request) {
+  size_t done = 0;
+  off_t offset = (off_t)request->page_num * PAGE_SIZE;
+
+  while (done < PAGE_SIZE) {
+    ssize_t result;
+    if (request->op == IO_OP_READ) {
+      result = pread(fd, request->buffer + done, PAGE_SIZE - done, offset + done);
     } else {
-      min_idx = mid_idx + 1;
+      result = pwrite(fd, request->buffer + done, PAGE_SIZE - done, offset + done);
+    }
+
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    if (result == 0) {
+      break; // end of file
     }
+    done += result;
   }
 
-  cursor->cell_num = min_idx;
-  return cursor;
+  return done;
 }
 
-/*
- * Return the position of the given key.
- */
-Cursor* table_find(Table* table, uint32_t key) {
-  uint32_t root_page_num = table->root_page_num;
-  void* root_node = get_page(table->pager, root_page_num);
+void* io_thread_main(void* arg) {
+  IoThreadPool* pool = arg;
 
-  if (*leaf_node_type(root_node) == NODE_LEAF) {
-    return leaf_node_find(table, root_page_num, key);
-  } else {
-    printf("Need to implement searching an internal node\n");
-    exit(EXIT_FAILURE);
-  }
-}
+  // Leave signals to the main thread, which may be waiting on them (see serve())
+  sigset_t signals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
 
-Cursor* table_end(Table* table) {
-  Cursor* cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = table->root_page_num;
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (pool->request_count == 0 && !pool->shutting_down) {
+      pthread_cond_wait(&pool->request_ready, &pool->lock);
+    }
+    if (pool->request_count == 0) {
+      break;
+    }
 
-  void* root_node = get_page(table->pager, table->root_page_num);
-  cursor->cell_num = *leaf_node_num_cells(root_node);
-  cursor->end_of_table = true;
-  return cursor;
-}
+    IoRequest request = pool->requests[pool->request_head];
+    pool->request_head = (pool->request_head + 1) % IO_QUEUE_DEPTH;
+    pool->request_count--;
+    pthread_mutex_unlock(&pool->lock);
 
-void cursor_advance(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* node = get_page(cursor->table->pager, page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+    ssize_t result = io_thread_transfer(pool->fd, &request);
 
-  cursor->cell_num++;
-  if (cursor->cell_num >= num_cells) {
-    cursor->end_of_table = true;
+    pthread_mutex_lock(&pool->lock);
+    pool->completions[pool->completion_count].page_num = request.page_num;
+    pool->completions[pool->completion_count].result = result;
+    pool->completion_count++;
+    pthread_cond_signal(&pool->completion_ready);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+void io_thread_pool_open(IoThreadPool* pool, int fd) {
+  pool->fd = fd;
+  pool->request_head = 0;
+  pool->request_count = 0;
+  pool->completion_count = 0;
+  pool->shutting_down = false;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->request_ready, NULL);
+  pthread_cond_init(&pool->completion_ready, NULL);
+
+  for (int i = 0; i < IO_THREAD_COUNT; i++) {
+    if (pthread_create(&pool->threads[i], NULL, io_thread_main, pool) != 0) {
+      printf("Error: failed to start I/O thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+void io_thread_pool_close(IoThreadPool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->shutting_down = true;
+  pthread_cond_broadcast(&pool->request_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < IO_THREAD_COUNT; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->completion_ready);
+  pthread_cond_destroy(&pool->request_ready);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+void io_thread_pool_queue(IoThreadPool* pool, IoRequest* request) {
+  pthread_mutex_lock(&pool->lock);
+  uint32_t tail = (pool->request_head + pool->request_count) % IO_QUEUE_DEPTH;
+  pool->requests[tail] = *request;
+  pool->request_count++;
+  pthread_cond_signal(&pool->request_ready);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+uint32_t io_thread_pool_reap(IoThreadPool* pool, IoCompletion* completions, uint32_t max_completions, bool wait) {
+  pthread_mutex_lock(&pool->lock);
+  while (wait && pool->completion_count == 0) {
+    pthread_cond_wait(&pool->completion_ready, &pool->lock);
+  }
+
+  uint32_t count = pool->completion_count < max_completions ? pool->completion_count : max_completions;
+  pool->completion_count -= count;
+  memcpy(completions, pool->completions + pool->completion_count, count * sizeof(IoCompletion));
+  pthread_mutex_unlock(&pool->lock);
+
+  // Each completed request cost its worker one pread/pwrite
+  stats.syscalls += count;
+  return count;
+}
+
+struct IoEngine_t {
+  IoEngineType type;
+  int fd;
+#ifdef __linux__
+  IoUring ring;
+#endif
+  IoThreadPool pool;
+};
+typedef struct IoEngine_t IoEngine;
+
+/*
+ * Open the requested engine, falling back to the thread pool when io_uring
+ * is not available (non-Linux, old kernel, or blocked by seccomp).
+ */
+void io_engine_open(IoEngine* engine, IoEngineType type, int fd) {
+  engine->fd = fd;
+#ifdef __linux__
+  if (type == IO_ENGINE_URING && io_uring_open(&engine->ring)) {
+    engine->type = IO_ENGINE_URING;
+    return;
+  }
+#endif
+  engine->type = IO_ENGINE_THREADS;
+  io_thread_pool_open(&engine->pool, fd);
+}
+
+void io_engine_close(IoEngine* engine) {
+  switch (engine->type) {
+    case IO_ENGINE_URING:
+#ifdef __linux__
+      io_uring_close(&engine->ring);
+#endif
+      break;
+    case IO_ENGINE_THREADS:
+      io_thread_pool_close(&engine->pool);
+      break;
+  }
+}
+
+void io_engine_queue(IoEngine* engine, IoRequest* request) {
+  switch (engine->type) {
+    case IO_ENGINE_URING:
+#ifdef __linux__
+      io_uring_queue(&engine->ring, engine->fd, request);
+#endif
+      break;
+    case IO_ENGINE_THREADS:
+      io_thread_pool_queue(&engine->pool, request);
+      break;
+  }
+}
+
+/*
+ * Hand queued requests to the kernel without waiting for them.
+ */
+void io_engine_submit(IoEngine* engine) {
+#ifdef __linux__
+  if (engine->type == IO_ENGINE_URING) {
+    io_uring_enter_ring(&engine->ring, false);
+  }
+#endif
+}
+
+/*
+ * Submit queued requests and collect finished ones. With wait set, block
+ * until at least one completes.
+ */
+uint32_t io_engine_reap(IoEngine* engine, IoCompletion* completions, uint32_t max_completions, bool wait) {
+  switch (engine->type) {
+    case IO_ENGINE_URING:
+#ifdef __linux__
+      io_uring_enter_ring(&engine->ring, wait);
+      return io_uring_reap(&engine->ring, completions, max_completions);
+#endif
+      break;
+    case IO_ENGINE_THREADS:
+      return io_thread_pool_reap(&engine->pool, completions, max_completions, wait);
+  }
+  return 0;
+}
+
+const char* io_engine_name(IoEngine* engine) {
+  switch (engine->type) {
+    case IO_ENGINE_URING:
+      return "io_uring";
+    case IO_ENGINE_THREADS:
+      return "threads";
+  }
+  return "unknown";
+}
+
+struct PagerOptions_t {
+  IoEngineType io_engine;
+  bool direct_io; // bypass the kernel page cache with O_DIRECT
+};
+typedef struct PagerOptions_t PagerOptions;
+
+struct Pager_t {
+  int fd;
+  uint32_t file_length;
+  uint32_t num_pages;
+  void* pages[MAX_TABLE_PAGE_NUM];
+  bool page_dirty[MAX_TABLE_PAGE_NUM]; // modified since it was read or last flushed
+  bool page_in_flight[MAX_TABLE_PAGE_NUM];
+  uint32_t num_in_flight;
+  bool direct_io; // O_DIRECT is in effect, not just requested
+  IoEngine io;
+};
+typedef struct Pager_t Pager;
+
+Pager* pager_open(const char* filename, PagerOptions* options) {
+  int flags = O_RDWR | O_CREAT;
+  bool direct_io = false;
+#ifdef O_DIRECT
+  if (options->direct_io) {
+    flags |= O_DIRECT;
+    direct_io = true;
+  }
+#endif
+  int fd = open(filename, flags, S_IWUSR | S_IRUSR);
+#ifdef O_DIRECT
+  if (fd == -1 && errno == EINVAL && options->direct_io) {
+    // Filesystem doesn't support O_DIRECT (e.g. tmpfs)
+    fprintf(stderr, "Warning: O_DIRECT is not supported for this file, using buffered I/O.\n");
+    fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    direct_io = false;
+  }
+#endif
+
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  off_t file_length = lseek(fd, 0, SEEK_END);
+
+  Pager* pager = malloc(sizeof(Pager));
+  pager->fd = fd;
+  pager->file_length = file_length;
+  pager->num_pages = file_length / PAGE_SIZE;
+  pager->direct_io = direct_io;
+
+  if (pager->file_length % PAGE_SIZE != 0) {
+    printf("DB file is not a whole number of pages. DB file is corrupted.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < MAX_TABLE_PAGE_NUM; i++) {
+    pager->pages[i] = NULL;
+    pager->page_dirty[i] = false;
+    pager->page_in_flight[i] = false;
+  }
+  pager->num_in_flight = 0;
+
+  io_engine_open(&pager->io, options->io_engine, fd);
+
+  return pager;
+}
+
+/*
+ * Page buffers are aligned to PAGE_SIZE so they can be used with O_DIRECT.
+ */
+void* pager_allocate_page() {
+  void* page;
+  if (posix_memalign(&page, PAGE_SIZE, PAGE_SIZE) != 0) {
+    printf("Error: failed to allocate page\n");
+    exit(EXIT_FAILURE);
+  }
+  return page;
+}
+
+uint32_t pager_reap(Pager* pager, bool wait) {
+  IoCompletion completions[IO_QUEUE_DEPTH];
+  uint32_t count = io_engine_reap(&pager->io, completions, IO_QUEUE_DEPTH, wait);
+
+  for (uint32_t i = 0; i < count; i++) {
+    IoCompletion* completion = &completions[i];
+    if (completion->result < 0) {
+      printf("Error: I/O on page %d failed: %d\n", completion->page_num, (int)-completion->result);
+      exit(EXIT_FAILURE);
+    }
+    if (completion->result != PAGE_SIZE) {
+      // A short read would leave garbage in the cache, a short write a
+      // truncated page on disk (e.g. on ENOSPC)
+      printf("Error: I/O on page %d transferred %d of %d bytes\n",
+          completion->page_num, (int)completion->result, PAGE_SIZE);
+      exit(EXIT_FAILURE);
+    }
+    pager->page_in_flight[completion->page_num] = false;
+    pager->num_in_flight--;
+  }
+
+  return count;
+}
+
+void pager_queue(Pager* pager, IoOp op, uint32_t page_num) {
+  while (pager->num_in_flight >= IO_QUEUE_DEPTH) {
+    pager_reap(pager, true);
+  }
+
+  IoRequest request;
+  request.op = op;
+  request.page_num = page_num;
+  request.buffer = pager->pages[page_num];
+  io_engine_queue(&pager->io, &request);
+
+  pager->page_in_flight[page_num] = true;
+  pager->num_in_flight++;
+}
+
+void pager_wait_page(Pager* pager, uint32_t page_num) {
+  while (pager->page_in_flight[page_num]) {
+    pager_reap(pager, true);
+  }
+}
+
+/*
+ * Wait for every queued read and write to finish.
+ */
+void pager_drain(Pager* pager) {
+  while (pager->num_in_flight > 0) {
+    pager_reap(pager, true);
+  }
+}
+
+void pager_close(Pager* pager) {
+  pager_drain(pager);
+  io_engine_close(&pager->io);
+
+  int result = close(pager->fd);
+  if (result < 0) {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < MAX_TABLE_PAGE_NUM; i++) {
+    if (pager->pages[i]) {
+      free(pager->pages[i]);
+      pager->pages[i] = NULL;
+    }
+  }
+  free(pager);
+}
+
+/*
+ * Queue a write of the page. It is only guaranteed to be on disk after
+ * pager_drain().
+ */
+void pager_flush(Pager* pager, uint32_t page_num) {
+  if (pager->pages[page_num] == NULL) {
+    printf("Error: Tried to flush null page\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // A prefetch may still be filling the buffer
+  pager_wait_page(pager, page_num);
+
+  stats.page_writes++;
+  pager_queue(pager, IO_OP_WRITE, page_num);
+  pager->page_dirty[page_num] = false;
+}
+
+/*
+ * Record that a cached page was modified and has to be written back.
+ */
+void pager_mark_dirty(Pager* pager, uint32_t page_num) {
+  pager->page_dirty[page_num] = true;
+}
+
+/*
+ * Start reading a page that is likely to be needed soon. Does nothing if
+ * the page is cached, not in the file yet, or the queue is full.
+ */
+void pager_prefetch(Pager* pager, uint32_t page_num) {
+  if (page_num >= pager->num_pages || pager->pages[page_num] != NULL) {
+    return;
+  }
+  if (pager->num_in_flight >= IO_QUEUE_DEPTH) {
+    return;
+  }
+
+  stats.page_reads++;
+  stats.page_prefetches++;
+  pager->pages[page_num] = pager_allocate_page();
+  pager_queue(pager, IO_OP_READ, page_num);
+}
+
+void* get_page(Pager* pager, uint32_t page_num) {
+  if (page_num >= MAX_TABLE_PAGE_NUM) {
+    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, MAX_TABLE_PAGE_NUM);
+    exit(EXIT_FAILURE);
+  }
+
+  if (pager->pages[page_num] == NULL) {
+    // Cache miss
+    stats.page_cache_misses++;
+    pager->pages[page_num] = pager_allocate_page();
+
+    if (page_num < pager->num_pages) {
+      // page exists in file
+      stats.page_reads++;
+      pager_queue(pager, IO_OP_READ, page_num);
+    } else {
+      // page doesn't exist in file. let's extend page
+      pager->num_pages = page_num + 1;
+      pager_mark_dirty(pager, page_num);
+    }
+  } else {
+    stats.page_cache_hits++;
+  }
+
+  pager_wait_page(pager, page_num);
+
+  return pager->pages[page_num];
+}
+
+void print_stats(Output* out, Pager* pager) {
+  output_printf(out, "pager.io_engine: %s\n", io_engine_name(&pager->io));
+  output_printf(out, "pager.direct_io: %s\n", pager->direct_io ? "on" : "off");
+  output_printf(out, "pager.cache_hits: %" PRIu64 "\n", stats.page_cache_hits);
+  output_printf(out, "pager.cache_misses: %" PRIu64 "\n", stats.page_cache_misses);
+  output_printf(out, "pager.page_reads: %" PRIu64 "\n", stats.page_reads);
+  output_printf(out, "pager.page_prefetches: %" PRIu64 "\n", stats.page_prefetches);
+  output_printf(out, "pager.page_writes: %" PRIu64 "\n", stats.page_writes);
+  output_printf(out, "pager.syscalls: %" PRIu64 "\n", stats.syscalls);
+  output_printf(out, "btree.leaf_splits: %" PRIu64 "\n", stats.leaf_splits);
+  output_printf(out, "btree.append_splits: %" PRIu64 "\n", stats.append_splits);
+  output_printf(out, "btree.root_splits: %" PRIu64 "\n", stats.root_splits);
+  print_latency_histogram(out, "statement.insert", &stats.insert_latency);
+  print_latency_histogram(out, "statement.select", &stats.select_latency);
+}
+
+/*
+ * `.stats dump` appends a snapshot to a file every interval from a background
+ * thread, so an idle REPL or server keeps reporting too.
+ */
+struct StatsDump_t {
+  Output* output; // NULL while no dump is running
+  uint32_t interval_seconds;
+  Pager* pager;
+  bool running;
+  pthread_t thread;
+  pthread_cond_t wakeup;
+};
+typedef struct StatsDump_t StatsDump;
+
+StatsDump stats_dump;
+
+void* stats_dump_main(void* arg) {
+  // Leave signals to the main thread, which may be waiting on them (see serve())
+  sigset_t signals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  pthread_mutex_lock(&stats_lock);
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  while (stats_dump.running) {
+    deadline.tv_sec += stats_dump.interval_seconds;
+    while (stats_dump.running &&
+        pthread_cond_timedwait(&stats_dump.wakeup, &stats_lock, &deadline) != ETIMEDOUT) {
+    }
+    if (!stats_dump.running) {
+      break;
+    }
+
+    output_printf(stats_dump.output, "--- %ld\n", (long)time(NULL));
+    print_stats(stats_dump.output, stats_dump.pager);
+    output_flush(stats_dump.output);
+    fflush(stats_dump.output->sink);
+  }
+  pthread_mutex_unlock(&stats_lock);
+
+  return NULL;
+}
+
+/*
+ * Both of these are called with stats_lock held.
+ */
+void stats_dump_stop() {
+  if (stats_dump.output == NULL) {
+    return;
+  }
+
+  stats_dump.running = false;
+  pthread_cond_signal(&stats_dump.wakeup);
+  // The dump thread needs stats_lock to see that it should stop
+  pthread_mutex_unlock(&stats_lock);
+  pthread_join(stats_dump.thread, NULL);
+  pthread_mutex_lock(&stats_lock);
+
+  pthread_cond_destroy(&stats_dump.wakeup);
+  fclose(stats_dump.output->sink);
+  close_output(stats_dump.output);
+  stats_dump.output = NULL;
+}
+
+bool stats_dump_start(const char* filename, uint32_t interval_seconds, Pager* pager) {
+  stats_dump_stop();
+
+  FILE* file = fopen(filename, "a");
+  if (file == NULL) {
+    return false;
+  }
+  stats_dump.output = new_output(file);
+  stats_dump.interval_seconds = interval_seconds;
+  stats_dump.pager = pager;
+  stats_dump.running = true;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&stats_dump.wakeup, &attr);
+  pthread_condattr_destroy(&attr);
+
+  if (pthread_create(&stats_dump.thread, NULL, stats_dump_main, NULL) != 0) {
+    printf("Error: failed to start stats dump thread\n");
+    exit(EXIT_FAILURE);
+  }
+  return true;
+}
+
+#define BTREE_MAX_DEPTH 32
+
+struct Table_t {
+  Pager* pager;
+  uint32_t root_page_num;
+  // Page numbers from the root down to the rightmost leaf. Keys beyond the
+  // current maximum always land in that leaf, so appends can skip table_find().
+  uint32_t rightmost_path[BTREE_MAX_DEPTH];
+  uint32_t rightmost_path_length;
+};
+typedef struct Table_t Table;
+
+void table_cache_rightmost_path(Table* table) {
+  uint32_t page_num = table->root_page_num;
+  uint32_t depth = 0;
+
+  while (true) {
+    if (depth >= BTREE_MAX_DEPTH) {
+      printf("Tree is deeper than %d levels. DB file is corrupted.\n", BTREE_MAX_DEPTH);
+      exit(EXIT_FAILURE);
+    }
+    table->rightmost_path[depth++] = page_num;
+
+    void* node = get_page(table->pager, page_num);
+    if (get_node_type(node) == NODE_LEAF) {
+      break;
+    }
+    page_num = *internal_node_right_child(node);
+  }
+
+  table->rightmost_path_length = depth;
+}
+
+uint32_t table_rightmost_leaf(Table* table) {
+  return table->rightmost_path[table->rightmost_path_length - 1];
+}
+
+Table* db_open(const char* filename, PagerOptions* options) {
+  Pager* pager = pager_open(filename, options);
+
+  Table *table = malloc(sizeof(Table));
+  table->pager = pager;
+
+  bool is_new_file = (pager->num_pages == 0);
+  void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+  if (is_new_file) {
+    // New database file. Initialize the header and page 1 as a root leaf node.
+    *db_header_root_page_num(header) = 1;
+    *db_header_next_row_id(header) = 1;
+    void* root_node = get_page(pager, 1);
+    initialize_leaf_node(root_node);
+    set_node_root(root_node, true);
+    pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+    pager_mark_dirty(pager, 1);
+  }
+  table->root_page_num = *db_header_root_page_num(header);
+
+  table_cache_rightmost_path(table);
+
+  return table;
+}
+
+void db_close(Table* table) {
+  for (uint32_t i = 0; i < table->pager->num_pages; i++) {
+    // Flush modified pages. Pages that were only read are already on disk.
+    if (table->pager->pages[i] == NULL || !table->pager->page_dirty[i]) {
+      continue;
+    }
+    pager_flush(table->pager, i);
+  }
+  // Writes were only queued above; submit them as one batch and wait
+  pager_drain(table->pager);
+
+  pager_close(table->pager);
+  free(table);
+}
+
+struct Cursor_t {
+  Table *table;
+  uint32_t page_num;
+  uint32_t cell_num;
+  bool end_of_table; // Indicates a position one past the last element
+  uint32_t parent_page_num; // Parent of the leaf on the path from the root, 0 for a root leaf
+  // Scans read ahead the leaves under the internal node they start in.
+  // 0 when there is nothing to prefetch.
+  uint32_t prefetch_parent_page_num;
+  uint32_t prefetch_next_child;
+  uint32_t leaves_visited;
+};
+typedef struct Cursor_t Cursor;
+
+#define SCAN_PREFETCH_WINDOW 8
+
+/*
+ * Keep up to SCAN_PREFETCH_WINDOW leaves ahead of the cursor being read.
+ */
+void cursor_prefetch_leaves(Cursor* cursor) {
+  if (cursor->prefetch_parent_page_num == 0) {
+    return;
+  }
+
+  Pager* pager = cursor->table->pager;
+  void* parent = get_page(pager, cursor->prefetch_parent_page_num);
+  uint32_t num_keys = *internal_node_num_keys(parent);
+  while (cursor->prefetch_next_child <= num_keys &&
+      cursor->prefetch_next_child <= cursor->leaves_visited + SCAN_PREFETCH_WINDOW) {
+    pager_prefetch(pager, *internal_node_child(parent, cursor->prefetch_next_child));
+    cursor->prefetch_next_child++;
+  }
+  io_engine_submit(&pager->io);
+}
+
+Cursor* table_start(Table* table) {
+  // Descend to the leftmost leaf
+  uint32_t parent_page_num = 0;
+  uint32_t page_num = table->root_page_num;
+  void* node = get_page(table->pager, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    parent_page_num = page_num;
+    page_num = *internal_node_child(node, 0);
+    node = get_page(table->pager, page_num);
+  }
+
+  Cursor* cursor = malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor->page_num = page_num;
+  cursor->cell_num = 0;
+  cursor->end_of_table = (*leaf_node_num_cells(node) == 0);
+  cursor->parent_page_num = parent_page_num;
+  cursor->prefetch_parent_page_num = parent_page_num;
+  cursor->prefetch_next_child = 1;
+  cursor->leaves_visited = 0;
+
+  cursor_prefetch_leaves(cursor);
+
+  return cursor;
+}
+
+Cursor* leaf_node_find(Table* table, uint32_t page_num, uint64_t key) {
+  void* node = get_page(table->pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  Cursor* cursor = malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor->page_num = page_num;
+  cursor->parent_page_num = 0;
+  cursor->prefetch_parent_page_num = 0;
+
+  // Binary Search
+  uint32_t min_idx = 0;
+  uint32_t one_past_max_idx = num_cells;
+  while (min_idx < one_past_max_idx) {
+    uint32_t mid_idx = min_idx + (one_past_max_idx - min_idx) / 2;
+    uint64_t mid_key = *leaf_node_key(node, mid_idx);
+
+    if (key == mid_key) {
+      cursor->cell_num = mid_idx;
+      return cursor;
+    }
+
+    if (key < mid_key) {
+      one_past_max_idx = mid_idx;
+    } else {
+      min_idx = mid_idx + 1;
+    }
+  }
+
+  cursor->cell_num = min_idx;
+  return cursor;
+}
+
+/*
+ * Return the index of the child which should contain the given key.
+ */
+uint32_t internal_node_find_child(void* node, uint64_t key) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+
+  // Binary search for the first child whose max key is >= key
+  uint32_t min_idx = 0;
+  uint32_t max_idx = num_keys; // there is one more child than key
+  while (min_idx != max_idx) {
+    uint32_t mid_idx = min_idx + (max_idx - min_idx) / 2;
+    uint64_t key_to_right = *internal_node_key(node, mid_idx);
+    if (key_to_right >= key) {
+      max_idx = mid_idx;
+    } else {
+      min_idx = mid_idx + 1;
+    }
+  }
+
+  return min_idx;
+}
+
+Cursor* internal_node_find(Table* table, uint32_t page_num, uint64_t key) {
+  void* node = get_page(table->pager, page_num);
+  uint32_t child_page_num = *internal_node_child(node, internal_node_find_child(node, key));
+  void* child = get_page(table->pager, child_page_num);
+  switch (get_node_type(child)) {
+    case NODE_LEAF: {
+      Cursor* cursor = leaf_node_find(table, child_page_num, key);
+      cursor->parent_page_num = page_num;
+      return cursor;
+    }
+    case NODE_INTERNAL:
+      return internal_node_find(table, child_page_num, key);
+  }
+}
+
+/*
+ * Return the position of the given key.
+ */
+Cursor* table_find(Table* table, uint64_t key) {
+  uint32_t root_page_num = table->root_page_num;
+  void* root_node = get_page(table->pager, root_page_num);
+
+  if (*leaf_node_type(root_node) == NODE_LEAF) {
+    return leaf_node_find(table, root_page_num, key);
+  } else {
+    return internal_node_find(table, root_page_num, key);
+  }
+}
+
+/*
+ * Return the position one past the largest key, i.e. where an append goes.
+ */
+Cursor* table_end(Table* table) {
+  Cursor* cursor = malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor->page_num = table_rightmost_leaf(table);
+  cursor->parent_page_num = table->rightmost_path_length > 1
+      ? table->rightmost_path[table->rightmost_path_length - 2]
+      : 0;
+  cursor->prefetch_parent_page_num = 0;
+
+  void* node = get_page(table->pager, cursor->page_num);
+  cursor->cell_num = *leaf_node_num_cells(node);
+  cursor->end_of_table = true;
+  return cursor;
+}
+
+void cursor_advance(Cursor* cursor) {
+  uint32_t page_num = cursor->page_num;
+  void* node = get_page(cursor->table->pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  cursor->cell_num++;
+  if (cursor->cell_num >= num_cells) {
+    // Advance to next leaf node
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0) {
+      // This was rightmost leaf
+      cursor->end_of_table = true;
+    } else {
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+      cursor->leaves_visited++;
+      cursor_prefetch_leaves(cursor);
+    }
   }
 }
 
@@ -463,6 +1625,8 @@ uint32_t get_unused_page_num(Pager* pager) {
 }
 
 void create_new_root(Table* table, uint32_t right_child_page_num) {
+  stats.root_splits++;
+
   void* root = get_page(table->pager, table->root_page_num);
   //void* right_child = get_page(table->pager, right_child_page_num);
   uint32_t left_child_page_num = get_unused_page_num(table->pager);
@@ -478,27 +1642,90 @@ void create_new_root(Table* table, uint32_t right_child_page_num) {
   uint32_t left_child_max_key = get_node_max_key(left_child);
   *internal_node_key(root, 0) = left_child_max_key;
   *internal_node_right_child(root) = right_child_page_num;
+  pager_mark_dirty(table->pager, table->root_page_num);
+  pager_mark_dirty(table->pager, left_child_page_num);
 }
 
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
-  void* old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  void* new_node = get_page(cursor->table->pager, new_page_num);
+/*
+ * After a non-root child splits, the old child keeps the lower keys and the
+ * new child goes right after it in the parent. The new child inherits the old
+ * child's key (or its place as right child) and the old child is re-keyed
+ * with its new max.
+ */
+void internal_node_insert_child(Table* table, uint32_t parent_page_num, uint32_t old_child_page_num, uint32_t new_child_page_num) {
+  void* parent = get_page(table->pager, parent_page_num);
+  void* old_child = get_page(table->pager, old_child_page_num);
+  uint32_t num_keys = *internal_node_num_keys(parent);
+
+  if (num_keys >= INTERNAL_NODE_MAX_CELLS) {
+    printf("Need to implement splitting internal node\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t old_child_max_key = get_node_max_key(old_child);
+  uint32_t index = internal_node_find_child(parent, old_child_max_key);
+  pager_mark_dirty(table->pager, parent_page_num);
+
+  if (index == num_keys) {
+    // The old child was the right child
+    *internal_node_num_keys(parent) = num_keys + 1;
+    *internal_node_child(parent, num_keys) = old_child_page_num;
+    *internal_node_key(parent, num_keys) = old_child_max_key;
+    *internal_node_right_child(parent) = new_child_page_num;
+    return;
+  }
+
+  // Make room for the new cell
+  memmove(internal_node_cell(parent, index + 1), internal_node_cell(parent, index),
+      (num_keys - index) * INTERNAL_NODE_CELL_SIZE);
+  *internal_node_num_keys(parent) = num_keys + 1;
+  *internal_node_child(parent, index + 1) = new_child_page_num;
+  *internal_node_key(parent, index) = old_child_max_key;
+}
+
+void leaf_node_split_and_insert(Cursor* cursor, uint64_t key, Row* value) {
+  stats.leaf_splits++;
+
+  Table* table = cursor->table;
+  void* old_node = get_page(table->pager, cursor->page_num);
+  uint32_t new_page_num = get_unused_page_num(table->pager);
+  void* new_node = get_page(table->pager, new_page_num);
   initialize_leaf_node(new_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+  *leaf_node_next_leaf(old_node) = new_page_num;
+
+  /*
+   * Appending past the end of the rightmost leaf means keys are arriving in
+   * increasing order. Splitting 50/50 there would leave every left half stuck
+   * half full, so keep the old leaf full and start the new leaf with only the
+   * new cell (SQLite's "quickbalance").
+   */
+  bool is_rightmost = (cursor->page_num == table_rightmost_leaf(table));
+  uint32_t left_split_count = LEAF_NODE_LEFT_SPLIT_COUNT;
+  if (is_rightmost && cursor->cell_num == LEAF_NODE_MAX_CELLS) {
+    stats.append_splits++;
+    left_split_count = LEAF_NODE_MAX_CELLS;
+  }
+  uint32_t right_split_count = (LEAF_NODE_MAX_CELLS + 1) - left_split_count;
 
-  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
+  // Cells below both the split point and the insertion point stay where they are
+  uint32_t first_moved_cell = left_split_count < cursor->cell_num ? left_split_count : cursor->cell_num;
+  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= (int32_t)first_moved_cell; i--) {
     void* destination_node;
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
+    uint32_t index_within_node;
+    if (i >= left_split_count) {
       destination_node = new_node;
+      index_within_node = i - left_split_count;
     } else {
       destination_node = old_node;
+      index_within_node = i;
     }
 
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
     void* dest = leaf_node_cell(destination_node, index_within_node);
 
     if (i == cursor->cell_num) {
-      seriarize_row(value, dest);
+      *leaf_node_key(destination_node, index_within_node) = key;
+      seriarize_row(value, leaf_node_value(destination_node, index_within_node));
     } else if (i > cursor->cell_num) {
       memcpy(dest, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
     } else {
@@ -506,18 +1733,21 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
     }
   }
 
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+  *(leaf_node_num_cells(old_node)) = left_split_count;
+  *(leaf_node_num_cells(new_node)) = right_split_count;
+  pager_mark_dirty(table->pager, cursor->page_num);
+  pager_mark_dirty(table->pager, new_page_num);
 
   if (is_node_root(old_node)) {
-    return create_new_root(cursor->table, new_page_num);
+    create_new_root(table, new_page_num);
   } else {
-    printf("Need to implement updating after split\n");
-    exit(EXIT_FAILURE);
+    internal_node_insert_child(table, cursor->parent_page_num, cursor->page_num, new_page_num);
   }
+
+  table_cache_rightmost_path(table);
 }
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
+void leaf_node_insert(Cursor* cursor, uint64_t key, Row* value) {
   void* node = get_page(cursor->table->pager, cursor->page_num);
 
   uint32_t num_cells = *leaf_node_num_cells(node);
@@ -537,6 +1767,7 @@ void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
   *(leaf_node_num_cells(node)) += 1;
   *(leaf_node_key(node, cursor->cell_num)) = key;
   seriarize_row(value, leaf_node_value(node, cursor->cell_num));
+  pager_mark_dirty(cursor->table->pager, cursor->page_num);
 }
 
 enum StatementType_t {
@@ -548,49 +1779,95 @@ typedef enum StatementType_t StatementType;
 struct Statement_t {
   StatementType type;
   Row row_to_insert; // only used by insert statement
+  bool assign_row_id; // only used by insert statement
 };
 typedef struct Statement_t Statement;
 
-enum PrepareResult_t {
-  PREPARE_SUCCESS,
-  PREPARE_NEGATIVE_ID,
-  PREPARE_STRING_TOO_LONG,
-  PREPARE_UNRECOGNIZED_STATEMENT,
-  PREPARE_SYNTAX_ERROR,
-};
-typedef enum PrepareResult_t PrepareResult;
+enum PrepareResult_t {
+  PREPARE_SUCCESS,
+  PREPARE_NEGATIVE_ID,
+  PREPARE_STRING_TOO_LONG,
+  PREPARE_UNRECOGNIZED_STATEMENT,
+  PREPARE_SYNTAX_ERROR,
+};
+typedef enum PrepareResult_t PrepareResult;
+
+PrepareResult prepare_row_values(char* username, char* email, Statement* statement) {
+  if (username == NULL || email == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  if (strlen(username) > COLUMN_USERNAME_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+
+  if (strlen(email) > COLUMN_EMAIL_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+
+  // src string's length are already validated above. strncpy zero-fills the
+  // rest of the column so rows never carry stale bytes to disk or clients.
+  strncpy(statement->row_to_insert.username, username, USERNAME_SIZE);
+  strncpy(statement->row_to_insert.email, email, EMAIL_SIZE);
+
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * insert into users (username, email) values (<username>, <email>)
+ *
+ * The id is assigned from the counter in the database header at execution.
+ */
+PrepareResult prepare_insert_into(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_INSERT;
+  statement->assign_row_id = true;
+
+  const char* delimiters = " (),";
+  strtok(input_buffer->buffer, delimiters); // insert
+  strtok(NULL, delimiters); // into
+  char* table_name = strtok(NULL, delimiters);
+  char* first_column = strtok(NULL, delimiters);
+  char* second_column = strtok(NULL, delimiters);
+  char* values_keyword = strtok(NULL, delimiters);
+  char* username = strtok(NULL, delimiters);
+  char* email = strtok(NULL, delimiters);
+
+  if (table_name == NULL || strcmp(table_name, "users") != 0 ||
+      first_column == NULL || strcmp(first_column, "username") != 0 ||
+      second_column == NULL || strcmp(second_column, "email") != 0 ||
+      values_keyword == NULL || strcmp(values_keyword, "values") != 0 ||
+      strtok(NULL, delimiters) != NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  return prepare_row_values(username, email, statement);
+}
 
 PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
   statement->type = STATEMENT_INSERT;
+  statement->assign_row_id = false;
   char* type = strtok(input_buffer->buffer, " ");
   char* id_str = strtok(NULL, " ");
   char* username = strtok(NULL, " ");
   char* email = strtok(NULL, " ");
 
-  int id = atoi(id_str);
-
-  if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
-  }
-
-  if (id_str == NULL || username == NULL || email == NULL) {
+  if (id_str == NULL) {
     return PREPARE_SYNTAX_ERROR;
   }
 
-  if (strlen(username) > COLUMN_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  if (id_str[0] == '-') {
+    return PREPARE_NEGATIVE_ID;
   }
 
-  if (strlen(email) > COLUMN_EMAIL_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  char* id_end;
+  errno = 0;
+  uint64_t id = strtoull(id_str, &id_end, 10);
+  if (id_str[0] < '0' || id_str[0] > '9' || *id_end != '\0' || errno == ERANGE) {
+    return PREPARE_SYNTAX_ERROR;
   }
+  statement->row_to_insert.id = id;
 
-  statement->row_to_insert.id = atoi(id_str);
-  // src string's length are already validated above
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
-
-  return PREPARE_SUCCESS;
+  return prepare_row_values(username, email, statement);
 }
 
 PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement) {
@@ -599,7 +1876,9 @@ PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement) {
 }
 
 PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement) {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
+  if (strncmp(input_buffer->buffer, "insert into ", 12) == 0) {
+    return prepare_insert_into(input_buffer, statement);
+  } else if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
     return prepare_insert(input_buffer, statement);
   } else if (strcmp(input_buffer->buffer, "select") == 0) {
     return prepare_select(input_buffer, statement);
@@ -612,69 +1891,107 @@ enum ExecuteResult_t {
   EXECUTE_SUCCESS,
   EXECUTE_DUPLICATE_KEY,
   EXECUTE_TABLE_FULL,
+  EXECUTE_ROW_IDS_EXHAUSTED,
 };
 typedef enum ExecuteResult_t ExecuteResult;
 
 ExecuteResult execute_insert(Statement* statement, Table* table) {
-  void* node = get_page(table->pager, table->root_page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-
   Row* row_to_insert = &(statement->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
-  Cursor* cursor = table_find(table, key_to_insert);
+  uint64_t* next_row_id = db_header_next_row_id(get_page(table->pager, DB_HEADER_PAGE_NUM));
+  if (statement->assign_row_id) {
+    if (*next_row_id == 0) {
+      // The counter wrapped after a row with id UINT64_MAX
+      return EXECUTE_ROW_IDS_EXHAUSTED;
+    }
+    row_to_insert->id = *next_row_id;
+  }
+  uint64_t key_to_insert = row_to_insert->id;
+
+  // Keys larger than everything in the table go straight to the rightmost leaf.
+  // Assigned ids always are, so they never pay for a duplicate-key search.
+  Cursor* cursor = table_end(table);
+  void* node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (num_cells > 0 && key_to_insert <= *leaf_node_key(node, num_cells - 1)) {
+    free(cursor);
+    cursor = table_find(table, key_to_insert);
+    node = get_page(table->pager, cursor->page_num);
+    num_cells = *leaf_node_num_cells(node);
+  }
 
   if (cursor->cell_num < num_cells) {
-    uint32_t key_at_cursor = *leaf_node_key(node, cursor->cell_num);
+    uint64_t key_at_cursor = *leaf_node_key(node, cursor->cell_num);
     if (key_at_cursor == key_to_insert) {
+      free(cursor);
       return EXECUTE_DUPLICATE_KEY;
     }
   }
 
+  if (num_cells >= LEAF_NODE_MAX_CELLS) {
+    // A split takes one new page, plus one more when the root splits
+    uint32_t pages_needed = is_node_root(node) ? 2 : 1;
+    if (table->pager->num_pages + pages_needed > MAX_TABLE_PAGE_NUM) {
+      free(cursor);
+      return EXECUTE_TABLE_FULL;
+    }
+  }
+
   leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
 
+  if (*next_row_id != 0 && key_to_insert >= *next_row_id) {
+    *next_row_id = key_to_insert + 1; // wraps to 0 after UINT64_MAX
+    pager_mark_dirty(table->pager, DB_HEADER_PAGE_NUM);
+  }
+
   free(cursor);
 
   return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_select(Statement* statement, Table* table) {
-  Row row;
+ExecuteResult execute_select(Statement* statement, Table* table, Output* output) {
   Cursor *cursor = table_start(table);
   while(!(cursor->end_of_table)) {
-    deseriarize_row(cursor_value(cursor), &row);
-    print_row(&row);
+    output_row(output, cursor_value(cursor));
     cursor_advance(cursor);
   }
+  output_end_of_rows(output);
 
   free(cursor);
 
   return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_statement(Statement* statement, Table* table) {
+ExecuteResult execute_statement(Statement* statement, Table* table, Output* output) {
+  uint64_t start_ns = now_ns();
+  ExecuteResult result;
   switch (statement->type) {
     case STATEMENT_INSERT:
-      return execute_insert(statement, table);
+      result = execute_insert(statement, table);
+      latency_histogram_record(&stats.insert_latency, now_ns() - start_ns);
+      break;
     case STATEMENT_SELECT:
-      return execute_select(statement, table);
+      result = execute_select(statement, table, output);
+      latency_histogram_record(&stats.select_latency, now_ns() - start_ns);
+      break;
   }
+  return result;
 }
 
-void print_constants() {
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
-  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+void print_constants(Output* out) {
+  output_printf(out, "ROW_SIZE: %d\n", ROW_SIZE);
+  output_printf(out, "COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  output_printf(out, "LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  output_printf(out, "LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+  output_printf(out, "LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+  output_printf(out, "LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
 }
 
 void print_leaf_node(void *node) {
   uint32_t num_cells = *leaf_node_num_cells(node);
   printf("leaf (size %d)\n", num_cells);
   for (uint32_t i = 0; i < num_cells; i++) {
-    uint32_t key = *leaf_node_key(node, i);
-    printf(" - %d : %d\n", i, key);
+    uint64_t key = *leaf_node_key(node, i);
+    printf(" - %d : %" PRIu64 "\n", i, key);
   }
 }
 
@@ -695,7 +2012,7 @@ void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
         printf("- leaf (size %d)\n", num_keys);
         for (uint32_t i = 0; i < num_keys; i++) {
           indent(indentation_level + 1);
-          printf("- %d\n", *leaf_node_key(node, i));
+          printf("- %" PRIu64 "\n", *leaf_node_key(node, i));
         }
       }
       break;
@@ -708,7 +2025,7 @@ void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
           uint32_t child_page_num = *internal_node_child(node, i);
           print_tree(pager, child_page_num, indentation_level + 1);
           indent(indentation_level + 1);
-          printf("- key %d\n", *internal_node_key(node, i));
+          printf("- key %" PRIu64 "\n", *internal_node_key(node, i));
         }
         print_tree(pager, *internal_node_right_child(node), indentation_level + 1);
       }
@@ -716,6 +2033,120 @@ void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
   }
 }
 
+struct TreeAnalysis_t {
+  uint32_t height;
+  uint32_t nodes_per_level[BTREE_MAX_DEPTH];
+  uint32_t leaf_nodes;
+  uint32_t leaf_cells;
+  uint32_t min_leaf_cells;
+  uint32_t internal_nodes;
+  uint32_t total_fan_out;
+  uint32_t min_fan_out;
+  uint32_t max_fan_out;
+  uint64_t free_bytes;
+  // Leaves are visited in key order, so these measure how far the on-disk
+  // page order drifts from key order.
+  int64_t prev_leaf_page_num;
+  uint32_t out_of_order_leaves;
+  uint64_t total_leaf_jump;
+};
+typedef struct TreeAnalysis_t TreeAnalysis;
+
+void analyze_tree(Pager* pager, uint32_t page_num, uint32_t level, TreeAnalysis* analysis) {
+  if (level >= BTREE_MAX_DEPTH) {
+    printf("Tree is deeper than %d levels. DB file is corrupted.\n", BTREE_MAX_DEPTH);
+    exit(EXIT_FAILURE);
+  }
+
+  void* node = get_page(pager, page_num);
+  analysis->nodes_per_level[level]++;
+  if (level + 1 > analysis->height) {
+    analysis->height = level + 1;
+  }
+
+  switch (get_node_type(node)) {
+    case NODE_LEAF:
+      {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        analysis->leaf_nodes++;
+        analysis->leaf_cells += num_cells;
+        if (analysis->leaf_nodes == 1 || num_cells < analysis->min_leaf_cells) {
+          analysis->min_leaf_cells = num_cells;
+        }
+        analysis->free_bytes += LEAF_NODE_SPACE_FOR_CELLS - num_cells * LEAF_NODE_CELL_SIZE;
+
+        if (analysis->prev_leaf_page_num >= 0) {
+          int64_t jump = (int64_t)page_num - analysis->prev_leaf_page_num;
+          if (jump != 1) {
+            analysis->out_of_order_leaves++;
+          }
+          analysis->total_leaf_jump += jump > 0 ? jump - 1 : 1 - jump;
+        }
+        analysis->prev_leaf_page_num = page_num;
+      }
+      break;
+    case NODE_INTERNAL:
+      {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        uint32_t fan_out = num_keys + 1;
+        analysis->internal_nodes++;
+        analysis->total_fan_out += fan_out;
+        if (analysis->internal_nodes == 1 || fan_out < analysis->min_fan_out) {
+          analysis->min_fan_out = fan_out;
+        }
+        if (fan_out > analysis->max_fan_out) {
+          analysis->max_fan_out = fan_out;
+        }
+        analysis->free_bytes += PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE - num_keys * INTERNAL_NODE_CELL_SIZE;
+
+        for (uint32_t i = 0; i <= num_keys; i++) {
+          analyze_tree(pager, *internal_node_child(node, i), level + 1, analysis);
+        }
+      }
+      break;
+  }
+}
+
+void print_tree_analysis(Output* out, Pager* pager, uint32_t root_page_num) {
+  TreeAnalysis analysis;
+  memset(&analysis, 0, sizeof(TreeAnalysis));
+  analysis.prev_leaf_page_num = -1;
+  analyze_tree(pager, root_page_num, 0, &analysis);
+
+  uint32_t tree_pages = analysis.leaf_nodes + analysis.internal_nodes;
+  uint32_t header_pages = 1;
+
+  output_printf(out, "height: %d\n", analysis.height);
+  for (uint32_t level = 0; level < analysis.height; level++) {
+    output_printf(out, "level %d: %d nodes\n", level, analysis.nodes_per_level[level]);
+  }
+  output_printf(out, "leaf nodes: %d, cells: %d, avg fill: %.1f%%, min fill: %.1f%% (of %d cells)\n",
+      analysis.leaf_nodes,
+      analysis.leaf_cells,
+      100.0 * analysis.leaf_cells / (analysis.leaf_nodes * LEAF_NODE_MAX_CELLS),
+      100.0 * analysis.min_leaf_cells / LEAF_NODE_MAX_CELLS,
+      LEAF_NODE_MAX_CELLS);
+  if (analysis.internal_nodes > 0) {
+    output_printf(out, "internal nodes: %d, avg fan-out: %.1f, min fan-out: %d, max fan-out: %d\n",
+        analysis.internal_nodes,
+        (double)analysis.total_fan_out / analysis.internal_nodes,
+        analysis.min_fan_out,
+        analysis.max_fan_out);
+  } else {
+    output_printf(out, "internal nodes: 0\n");
+  }
+  output_printf(out, "free space: %" PRIu64 " bytes (%.1f%% of %d tree pages), unreachable pages: %d\n",
+      analysis.free_bytes,
+      100.0 * analysis.free_bytes / ((uint64_t)tree_pages * PAGE_SIZE),
+      tree_pages,
+      pager->num_pages - header_pages - tree_pages);
+  uint32_t leaf_transitions = analysis.leaf_nodes - 1;
+  output_printf(out, "leaf page order: %d of %d transitions out of order, mean jump %.1f pages\n",
+      analysis.out_of_order_leaves,
+      leaf_transitions,
+      leaf_transitions > 0 ? (double)analysis.total_leaf_jump / leaf_transitions : 0.0);
+}
+
 enum MetaCommandResult_t {
   META_COMMAND_SUCCESS,
   META_COMMAND_UNRECOGNIZED_COMMAND,
@@ -723,39 +2154,589 @@ enum MetaCommandResult_t {
 
 typedef enum MetaCommandResult_t MetaCommandResult;
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
+/*
+ * .mode [text|csv|tsv|binary]
+ */
+MetaCommandResult do_mode_command(InputBuffer* input_buffer, Output* output) {
+  const char* mode = input_buffer->buffer + strlen(".mode");
+  if (*mode == 0) {
+    output_printf(output, "%s\n", OUTPUT_MODE_NAMES[output->mode]);
+    return META_COMMAND_SUCCESS;
+  }
+  if (*mode != ' ') {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+  mode++;
+
+  for (uint32_t i = 0; i < sizeof(OUTPUT_MODE_NAMES) / sizeof(OUTPUT_MODE_NAMES[0]); i++) {
+    if (strcmp(mode, OUTPUT_MODE_NAMES[i]) == 0) {
+      output->mode = (OutputMode)i;
+      return META_COMMAND_SUCCESS;
+    }
+  }
+  return META_COMMAND_UNRECOGNIZED_COMMAND;
+}
+
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table, Output* output) {
   if (strcmp(input_buffer->buffer, ".exit") == 0) {
     db_close(table);
     exit(EXIT_SUCCESS);
   } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
-    printf("Constants:\n");
-    print_constants();
+    output_printf(output, "Constants:\n");
+    print_constants(output);
     return META_COMMAND_SUCCESS;
   } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
     printf("Tree:\n");
     print_tree(table->pager, table->root_page_num, 0);
     return META_COMMAND_SUCCESS;
-  }else {
+  } else if (strncmp(input_buffer->buffer, ".mode", 5) == 0) {
+    return do_mode_command(input_buffer, output);
+  } else if (strcmp(input_buffer->buffer, ".analyze") == 0) {
+    output_printf(output, "Analysis:\n");
+    print_tree_analysis(output, table->pager, table->root_page_num);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+    output_printf(output, "Stats:\n");
+    print_stats(output, table->pager);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".stats reset") == 0) {
+    reset_stats();
+    output_printf(output, "Stats reset.\n");
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".stats dump off") == 0) {
+    stats_dump_stop();
+    output_printf(output, "Stats dump stopped.\n");
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".stats dump ", 12) == 0) {
+    char filename[256];
+    uint32_t interval_seconds;
+    if (sscanf(input_buffer->buffer, ".stats dump %255s %u", filename, &interval_seconds) != 2 ||
+        interval_seconds == 0) {
+      output_printf(output, "Usage: .stats dump <filename> <interval_seconds> | .stats dump off\n");
+      return META_COMMAND_SUCCESS;
+    }
+    if (!stats_dump_start(filename, interval_seconds, table->pager)) {
+      output_printf(output, "Error: could not open stats dump file '%s'.\n", filename);
+      return META_COMMAND_SUCCESS;
+    }
+    output_printf(output, "Dumping stats to '%s' every %u seconds.\n", filename, interval_seconds);
+    return META_COMMAND_SUCCESS;
+  } else {
     return META_COMMAND_UNRECOGNIZED_COMMAND;
   }
 }
 
+/*
+ * Prepare and execute one statement, writing its rows and result message to
+ * output. Returns whether it executed successfully.
+ */
+bool run_statement(InputBuffer* input_buffer, Table* table, Output* output) {
+  Statement statement;
+  switch (prepare_statement(input_buffer, &statement)) {
+    case PREPARE_SUCCESS:
+      break;
+    case PREPARE_STRING_TOO_LONG:
+      output_printf(output, "String is too long.\n");
+      return false;
+    case PREPARE_NEGATIVE_ID:
+      output_printf(output, "ID must be positive.\n");
+      return false;
+    case PREPARE_UNRECOGNIZED_STATEMENT:
+      output_printf(output, "Unrecognized statement: '%s'.\n", input_buffer->buffer);
+      return false;
+    case PREPARE_SYNTAX_ERROR:
+      output_printf(output, "Syntax error. Could not parse statement '%s'.\n", input_buffer->buffer);
+      return false;
+  }
+
+  switch (execute_statement(&statement, table, output)) {
+    case EXECUTE_SUCCESS:
+      output_printf(output, "Executed.\n");
+      return true;
+    case EXECUTE_DUPLICATE_KEY:
+      output_printf(output, "Error: Duplicate key.\n");
+      return false;
+    case EXECUTE_TABLE_FULL:
+      output_printf(output, "Error: Table full.\n");
+      return false;
+    case EXECUTE_ROW_IDS_EXHAUSTED:
+      output_printf(output, "Error: No row ids left to assign. Insert with an explicit id.\n");
+      return false;
+  }
+  return false;
+}
+
+/*
+ * Server Mode
+ *
+ * `db --serve <socket> <file>` shares one Table and page cache between many
+ * local clients. A single epoll loop owns the table, so statements from
+ * different connections are serialized without any locking.
+ *
+ * Every message is a 4-byte big-endian length followed by that many bytes.
+ * A request carries one statement. A response carries a status byte
+ * (SERVER_STATUS_*) followed by exactly what the REPL would have printed.
+ */
+#ifdef __linux__
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_CHUNK_SIZE 16384
+#define SERVER_MAX_REQUEST_SIZE (64 * 1024)
+// Backpressure: a connection is not read from while this much input is
+// unparsed, and its requests are not run while this much output is unsent.
+#define SERVER_MAX_PENDING_INPUT (MESSAGE_LENGTH_SIZE + SERVER_MAX_REQUEST_SIZE)
+#define SERVER_MAX_PENDING_OUTPUT OUTPUT_BUFFER_SIZE
+
+const uint32_t MESSAGE_LENGTH_SIZE = sizeof(uint32_t);
+
+enum ServerStatus_t {
+  SERVER_STATUS_OK,
+  SERVER_STATUS_ERROR,
+};
+typedef enum ServerStatus_t ServerStatus;
+
+struct ByteBuffer_t {
+  char* data;
+  size_t length;
+  size_t capacity;
+};
+typedef struct ByteBuffer_t ByteBuffer;
+
+void byte_buffer_reserve(ByteBuffer* buffer, size_t additional) {
+  if (buffer->length + additional <= buffer->capacity) {
+    return;
+  }
+
+  size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+  while (capacity < buffer->length + additional) {
+    capacity *= 2;
+  }
+  buffer->data = realloc(buffer->data, capacity);
+  buffer->capacity = capacity;
+}
+
+void byte_buffer_append(ByteBuffer* buffer, const void* data, size_t length) {
+  byte_buffer_reserve(buffer, length);
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+}
+
+void byte_buffer_consume(ByteBuffer* buffer, size_t length) {
+  memmove(buffer->data, buffer->data + length, buffer->length - length);
+  buffer->length -= length;
+}
+
+struct Connection_t {
+  int fd;
+  ByteBuffer input;
+  ByteBuffer output;
+  Output* result; // reused for every response, carries the connection's .mode
+  bool peer_closed;
+  uint32_t events; // currently registered with epoll
+};
+typedef struct Connection_t Connection;
+
+void connection_close(int epoll_fd, Connection* connection) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  free(connection->input.data);
+  free(connection->output.data);
+  close_output(connection->result);
+  free(connection);
+}
+
+void connection_respond(Connection* connection, ServerStatus status, const char* body, size_t body_length) {
+  uint32_t length = htonl(1 + body_length);
+  uint8_t status_byte = status;
+  byte_buffer_append(&connection->output, &length, MESSAGE_LENGTH_SIZE);
+  byte_buffer_append(&connection->output, &status_byte, 1);
+  if (body_length > 0) {
+    byte_buffer_append(&connection->output, body, body_length);
+  }
+}
+
+void connection_handle_request(Connection* connection, Table* table, const char* request, uint32_t request_length) {
+  InputBuffer input_buffer;
+  input_buffer.buffer = malloc(request_length + 1);
+  input_buffer.buffer_length = request_length + 1;
+  input_buffer.input_length = request_length;
+  memcpy(input_buffer.buffer, request, request_length);
+  input_buffer.buffer[request_length] = 0;
+
+  Output* result = connection->result;
+  output_reset(result);
+
+  ServerStatus status = SERVER_STATUS_ERROR;
+  if (strcmp(input_buffer.buffer, ".exit") == 0 || strcmp(input_buffer.buffer, ".btree") == 0) {
+    // .exit would stop the whole server and .btree prints straight to stdout
+    output_printf(result, "Error: '%s' is only available in the REPL.\n", input_buffer.buffer);
+  } else if (input_buffer.buffer[0] == '.') {
+    if (do_meta_command(&input_buffer, table, result) == META_COMMAND_SUCCESS) {
+      status = SERVER_STATUS_OK;
+    } else {
+      output_printf(result, "Unrecognized command: '%s'.\n", input_buffer.buffer);
+    }
+  } else if (run_statement(&input_buffer, table, result)) {
+    status = SERVER_STATUS_OK;
+  }
+
+  connection_respond(connection, status, result->buffer, result->length);
+  free(input_buffer.buffer);
+}
+
+/*
+ * Read until the socket is drained or SERVER_MAX_PENDING_INPUT bytes are
+ * buffered. Returns false on a read error.
+ */
+bool connection_read(Connection* connection) {
+  while (connection->input.length < SERVER_MAX_PENDING_INPUT) {
+    byte_buffer_reserve(&connection->input, SERVER_READ_CHUNK_SIZE);
+    size_t room = connection->input.capacity - connection->input.length;
+    if (room > SERVER_MAX_PENDING_INPUT - connection->input.length) {
+      room = SERVER_MAX_PENDING_INPUT - connection->input.length;
+    }
+
+    ssize_t bytes_read = read(connection->fd, connection->input.data + connection->input.length, room);
+    if (bytes_read > 0) {
+      connection->input.length += bytes_read;
+      continue;
+    }
+    if (bytes_read == 0) {
+      connection->peer_closed = true;
+      break;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    }
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Run buffered requests until no complete one is left or the pending output
+ * reaches SERVER_MAX_PENDING_OUTPUT, in which case held_back is set. Returns
+ * false on a malformed request.
+ */
+bool connection_run_requests(Connection* connection, Table* table, bool* held_back) {
+  bool valid = true;
+  size_t offset = 0;
+  *held_back = false;
+  while (connection->input.length - offset >= MESSAGE_LENGTH_SIZE) {
+    uint32_t request_length;
+    memcpy(&request_length, connection->input.data + offset, MESSAGE_LENGTH_SIZE);
+    request_length = ntohl(request_length);
+    if (request_length == 0 || request_length > SERVER_MAX_REQUEST_SIZE) {
+      valid = false;
+      break;
+    }
+    if (connection->input.length - offset - MESSAGE_LENGTH_SIZE < request_length) {
+      break;
+    }
+    if (connection->output.length >= SERVER_MAX_PENDING_OUTPUT) {
+      *held_back = true;
+      break;
+    }
+
+    connection_handle_request(connection, table, connection->input.data + offset + MESSAGE_LENGTH_SIZE, request_length);
+    offset += MESSAGE_LENGTH_SIZE + request_length;
+  }
+  byte_buffer_consume(&connection->input, offset);
+
+  return valid;
+}
+
+/*
+ * Write as much pending output as the socket takes. Returns false on a write
+ * error.
+ */
+bool connection_write(Connection* connection) {
+  size_t written = 0;
+  while (written < connection->output.length) {
+    ssize_t result = send(connection->fd, connection->output.data + written,
+        connection->output.length - written, MSG_NOSIGNAL);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return false;
+    }
+    written += result;
+  }
+  byte_buffer_consume(&connection->output, written);
+
+  return true;
+}
+
+/*
+ * Only ask epoll for readability while the connection has room for more
+ * input and output, and for writability while output is pending.
+ */
+void connection_update_events(int epoll_fd, Connection* connection) {
+  uint32_t events = 0;
+  if (!connection->peer_closed &&
+      connection->input.length < SERVER_MAX_PENDING_INPUT &&
+      connection->output.length < SERVER_MAX_PENDING_OUTPUT) {
+    events |= EPOLLIN;
+  }
+  if (connection->output.length > 0) {
+    events |= EPOLLOUT;
+  }
+
+  if (events != connection->events) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = connection;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+    connection->events = events;
+  }
+}
+
+/*
+ * Handle a readiness event. Returns false once the connection should be
+ * closed.
+ */
+bool connection_service(int epoll_fd, Connection* connection, Table* table, uint32_t events) {
+  if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !connection->peer_closed) {
+    if (!connection_read(connection)) {
+      return false;
+    }
+  }
+
+  bool held_back;
+  do {
+    bool valid = connection_run_requests(connection, table, &held_back);
+    // Flush responses even when the request stream turned out malformed
+    if (!connection_write(connection) || !valid) {
+      return false;
+    }
+    // Writing may have made room for requests that were held back
+  } while (held_back && connection->output.length < SERVER_MAX_PENDING_OUTPUT);
+
+  if (connection->peer_closed && connection->output.length == 0) {
+    return false;
+  }
+
+  connection_update_events(epoll_fd, connection);
+  return true;
+}
+
+int server_listen(const char* socket_path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    printf("Error: socket path is too long.\n");
+    return -1;
+  }
+  strcpy(address.sun_path, socket_path);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    printf("Error: failed to create socket: %d\n", errno);
+    return -1;
+  }
+
+  unlink(socket_path);
+  if (bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    printf("Error: failed to bind '%s': %d\n", socket_path, errno);
+    close(listen_fd);
+    return -1;
+  }
+  if (listen(listen_fd, SOMAXCONN) < 0) {
+    printf("Error: failed to listen on '%s': %d\n", socket_path, errno);
+    close(listen_fd);
+    return -1;
+  }
+
+  return listen_fd;
+}
+
+/*
+ * At the fd limit a pending connection can't be accepted, and the
+ * level-triggered listener would report it again immediately. Keep a spare
+ * fd around so it can be accepted and closed instead.
+ */
+int server_open_reserve_fd() {
+  return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+void server_accept(int epoll_fd, int listen_fd, int* reserve_fd) {
+  while (true) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno == EMFILE || errno == ENFILE) && *reserve_fd >= 0) {
+        // accept fails with EMFILE before it looks at the backlog, so only
+        // the accept with the reserve fd freed tells whether it's empty
+        close(*reserve_fd);
+        fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd >= 0) {
+          close(fd);
+        }
+        *reserve_fd = server_open_reserve_fd();
+        if (fd >= 0) {
+          continue;
+        }
+      }
+      // EAGAIN once the backlog is empty
+      return;
+    }
+
+    Connection* connection = calloc(1, sizeof(Connection));
+    connection->fd = fd;
+    connection->result = new_output(NULL);
+    connection->events = EPOLLIN;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+int serve(const char* socket_path, Table* table) {
+  int listen_fd = server_listen(socket_path);
+  if (listen_fd < 0) {
+    return EXIT_FAILURE;
+  }
+
+  // Shut down cleanly on SIGINT/SIGTERM so the table gets flushed
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  int reserve_fd = server_open_reserve_fd();
+  if (epoll_fd < 0 || signal_fd < 0 || reserve_fd < 0) {
+    printf("Error: failed to set up event loop: %d\n", errno);
+    return EXIT_FAILURE;
+  }
+
+  // Connections are identified by pointer; these two by their address
+  static int listener_tag;
+  static int signal_tag;
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = &listener_tag;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+  event.data.ptr = &signal_tag;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+
+  printf("Listening on %s\n", socket_path);
+  fflush(stdout);
+
+  bool running = true;
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  while (running) {
+    pthread_mutex_unlock(&stats_lock);
+    int num_events = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
+    pthread_mutex_lock(&stats_lock);
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error: epoll_wait failed: %d\n", errno);
+      break;
+    }
+
+    for (int i = 0; i < num_events; i++) {
+      if (events[i].data.ptr == &listener_tag) {
+        server_accept(epoll_fd, listen_fd, &reserve_fd);
+        continue;
+      }
+      if (events[i].data.ptr == &signal_tag) {
+        running = false;
+        continue;
+      }
+
+      Connection* connection = events[i].data.ptr;
+      if (!connection_service(epoll_fd, connection, table, events[i].events)) {
+        connection_close(epoll_fd, connection);
+      }
+    }
+  }
+
+  close(epoll_fd);
+  close(signal_fd);
+  close(listen_fd);
+  if (reserve_fd >= 0) {
+    close(reserve_fd);
+  }
+  unlink(socket_path);
+
+  return EXIT_SUCCESS;
+}
+#else
+int serve(const char* socket_path, Table* table) {
+  printf("Error: --serve requires Linux (epoll).\n");
+  return EXIT_FAILURE;
+}
+#endif
+
 int main(int argc, char* argv[]) {
-  if (argc < 2) {
+  char* filename = NULL;
+  char* socket_path = NULL;
+  PagerOptions pager_options;
+  pager_options.io_engine = IO_ENGINE_URING;
+  pager_options.direct_io = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--io=uring") == 0) {
+      pager_options.io_engine = IO_ENGINE_URING;
+    } else if (strcmp(argv[i], "--io=threads") == 0) {
+      pager_options.io_engine = IO_ENGINE_THREADS;
+    } else if (strcmp(argv[i], "--direct-io") == 0) {
+      pager_options.direct_io = true;
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (argv[i][0] == '-') {
+      printf("Error: Unknown option '%s'.\n", argv[i]);
+      exit(EXIT_FAILURE);
+    } else {
+      filename = argv[i];
+    }
+  }
+
+  if (filename == NULL) {
     printf("Error: Must supply a database filename.\n");
     exit(EXIT_FAILURE);
   }
 
-  char* filename = argv[1];
-  Table* table = db_open(filename);
+  Table* table = db_open(filename, &pager_options);
+
+  if (socket_path != NULL) {
+    pthread_mutex_lock(&stats_lock);
+    int status = serve(socket_path, table);
+    db_close(table);
+    exit(status);
+  }
+
   InputBuffer* input_buffer = new_input_buffer();
+  Output* output = new_output(stdout);
 
+  pthread_mutex_lock(&stats_lock);
   while (true) {
     print_prompt();
+    pthread_mutex_unlock(&stats_lock);
     read_input(input_buffer);
+    pthread_mutex_lock(&stats_lock);
 
     if(input_buffer->buffer[0] == '.') {
-      switch(do_meta_command(input_buffer, table)) {
+      MetaCommandResult result = do_meta_command(input_buffer, table, output);
+      output_flush(output);
+      switch(result) {
         case META_COMMAND_SUCCESS:
           continue;
         case META_COMMAND_UNRECOGNIZED_COMMAND:
@@ -764,37 +2745,11 @@ int main(int argc, char* argv[]) {
       }
     }
 
-    Statement statement;
-    switch (prepare_statement(input_buffer, &statement)) {
-      case PREPARE_SUCCESS:
-        break;
-      case PREPARE_STRING_TOO_LONG:
-        printf("String is too long.\n");
-        continue;
-      case PREPARE_NEGATIVE_ID:
-        printf("ID must be positive.\n");
-        continue;
-      case PREPARE_UNRECOGNIZED_STATEMENT:
-        printf("Unrecognized statement: '%s'.\n", input_buffer->buffer);
-        continue;
-      case PREPARE_SYNTAX_ERROR:
-        printf("Syntax error. Could not parse statement '%s'.\n", input_buffer->buffer);
-        continue;
-    }
-
-    switch (execute_statement(&statement, table)) {
-      case EXECUTE_SUCCESS:
-        printf("Executed.\n");
-        break;
-      case EXECUTE_DUPLICATE_KEY:
-        printf("Error: Duplicate key.\n");
-        break;
-      case EXECUTE_TABLE_FULL:
-        printf("Error: Table full.\n");
-        break;
-    }
+    run_statement(input_buffer, table, output);
+    output_flush(output);
   }
 
+  close_output(output);
   close_input_buffer(input_buffer);
   db_close(table);
   exit(EXIT_SUCCESS);
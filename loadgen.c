@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Load generator for `db --serve`.
+ *
+ * Opens many connections to the server socket and keeps one request in
+ * flight on each, then reports throughput and the latency distribution seen
+ * by the clients. Requests are auto-increment inserts, with a select mixed
+ * in every select_every requests when it is non-zero.
+ *
+ * Only successful responses count towards throughput and latency. Any error
+ * reply (e.g. "Table full" once the server's table runs out of pages) makes
+ * loadgen report the failures and exit non-zero. The default workload is
+ * sized to fit in a fresh table, which holds roughly 1,280 rows.
+ *
+ * Usage: loadgen <socket> [connections] [requests_per_connection] [select_every]
+ */
+
+#define DEFAULT_CONNECTIONS 50
+#define DEFAULT_REQUESTS_PER_CONNECTION 20
+#define MAX_EVENTS 256
+#define READ_CHUNK_SIZE 65536
+#define MAX_REQUEST_SIZE 128
+
+const uint32_t MESSAGE_LENGTH_SIZE = sizeof(uint32_t);
+
+struct Client_t {
+  int fd;
+  uint32_t id;
+  uint32_t requests_sent;
+  uint64_t request_started_ns;
+  char request[MAX_REQUEST_SIZE];
+  uint32_t request_length; // including the length prefix
+  uint32_t request_written;
+  bool watching_writable;
+  char* response;
+  size_t response_length;
+  size_t response_capacity;
+};
+typedef struct Client_t Client;
+
+struct LoadResult_t {
+  uint64_t* latencies_ns;
+  uint64_t num_latencies;
+  uint64_t errors;
+};
+typedef struct LoadResult_t LoadResult;
+
+struct LoadConfig_t {
+  uint32_t connections;
+  uint32_t requests_per_connection;
+  uint32_t select_every;
+};
+typedef struct LoadConfig_t LoadConfig;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int connect_to_server(const char* socket_path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    printf("Error: socket path is too long.\n");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(address.sun_path, socket_path);
+
+  // Connect blocking so a full accept backlog just waits, then switch to
+  // non-blocking for the event loop.
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    printf("Error: failed to connect to '%s': %d\n", socket_path, errno);
+    exit(EXIT_FAILURE);
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  return fd;
+}
+
+void client_watch_writable(int epoll_fd, Client* client, bool watch) {
+  if (client->watching_writable == watch) {
+    return;
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLIN | (watch ? EPOLLOUT : 0);
+  event.data.ptr = client;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+  client->watching_writable = watch;
+}
+
+void client_write(int epoll_fd, Client* client) {
+  while (client->request_written < client->request_length) {
+    ssize_t result = send(client->fd, client->request + client->request_written,
+        client->request_length - client->request_written, MSG_NOSIGNAL);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      printf("Error: failed to send request: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    client->request_written += result;
+  }
+
+  client_watch_writable(epoll_fd, client, client->request_written < client->request_length);
+}
+
+/*
+ * Send the client's next request. Returns false once it has sent them all.
+ */
+bool client_send_next(int epoll_fd, Client* client, LoadConfig* config) {
+  if (client->requests_sent == config->requests_per_connection) {
+    return false;
+  }
+
+  char* statement = client->request + MESSAGE_LENGTH_SIZE;
+  size_t statement_capacity = MAX_REQUEST_SIZE - MESSAGE_LENGTH_SIZE;
+  int statement_length;
+  if (config->select_every > 0 && (client->requests_sent + 1) % config->select_every == 0) {
+    statement_length = snprintf(statement, statement_capacity, "select");
+  } else {
+    statement_length = snprintf(statement, statement_capacity,
+        "insert into users (username, email) values (user%u_%u, user%u_%u@example.com)",
+        client->id, client->requests_sent, client->id, client->requests_sent);
+  }
+
+  uint32_t length = htonl(statement_length);
+  memcpy(client->request, &length, MESSAGE_LENGTH_SIZE);
+  client->request_length = MESSAGE_LENGTH_SIZE + statement_length;
+  client->request_written = 0;
+  client->requests_sent++;
+  client->request_started_ns = now_ns();
+
+  client_write(epoll_fd, client);
+  return true;
+}
+
+/*
+ * Read whatever has arrived. Returns true when a full response is in.
+ */
+bool client_read(Client* client, LoadResult* result) {
+  while (true) {
+    if (client->response_capacity - client->response_length < READ_CHUNK_SIZE) {
+      client->response_capacity = client->response_capacity * 2 + READ_CHUNK_SIZE;
+      client->response = realloc(client->response, client->response_capacity);
+    }
+
+    ssize_t bytes_read = read(client->fd, client->response + client->response_length,
+        client->response_capacity - client->response_length);
+    if (bytes_read > 0) {
+      client->response_length += bytes_read;
+      continue;
+    }
+    if (bytes_read == 0) {
+      printf("Error: server closed the connection\n");
+      exit(EXIT_FAILURE);
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    }
+    printf("Error: failed to read response: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  if (client->response_length < MESSAGE_LENGTH_SIZE) {
+    return false;
+  }
+  uint32_t length;
+  memcpy(&length, client->response, MESSAGE_LENGTH_SIZE);
+  length = ntohl(length);
+  if (client->response_length < MESSAGE_LENGTH_SIZE + length) {
+    return false;
+  }
+
+  if (length == 0 || client->response[MESSAGE_LENGTH_SIZE] != 0) {
+    result->errors++;
+  } else {
+    result->latencies_ns[result->num_latencies++] = now_ns() - client->request_started_ns;
+  }
+
+  // Only one request is ever in flight, so nothing follows the response
+  client->response_length = 0;
+  return true;
+}
+
+int compare_uint64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+uint64_t percentile(LoadResult* result, double percentile) {
+  uint64_t index = (uint64_t)(result->num_latencies * percentile / 100.0);
+  if (index >= result->num_latencies) {
+    index = result->num_latencies - 1;
+  }
+  return result->latencies_ns[index];
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    printf("Usage: %s <socket> [connections] [requests_per_connection] [select_every]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  const char* socket_path = argv[1];
+  LoadConfig config;
+  config.connections = argc > 2 ? atoi(argv[2]) : DEFAULT_CONNECTIONS;
+  config.requests_per_connection = argc > 3 ? atoi(argv[3]) : DEFAULT_REQUESTS_PER_CONNECTION;
+  config.select_every = argc > 4 ? atoi(argv[4]) : 0;
+  if (config.connections == 0 || config.requests_per_connection == 0) {
+    printf("Error: connections and requests_per_connection must be positive.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  LoadResult result;
+  result.num_latencies = 0;
+  result.errors = 0;
+  result.latencies_ns = malloc(sizeof(uint64_t) * config.connections * config.requests_per_connection);
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  Client* clients = calloc(config.connections, sizeof(Client));
+  for (uint32_t i = 0; i < config.connections; i++) {
+    Client* client = &clients[i];
+    client->fd = connect_to_server(socket_path);
+    client->id = i;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event);
+  }
+
+  uint64_t started_ns = now_ns();
+  uint32_t active = config.connections;
+  for (uint32_t i = 0; i < config.connections; i++) {
+    client_send_next(epoll_fd, &clients[i], &config);
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  while (active > 0) {
+    int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error: epoll_wait failed: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < num_events; i++) {
+      Client* client = events[i].data.ptr;
+      if (events[i].events & EPOLLOUT) {
+        client_write(epoll_fd, client);
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        if (client_read(client, &result) && !client_send_next(epoll_fd, client, &config)) {
+          epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+          close(client->fd);
+          active--;
+        }
+      }
+    }
+  }
+  uint64_t elapsed_ns = now_ns() - started_ns;
+
+  qsort(result.latencies_ns, result.num_latencies, sizeof(uint64_t), compare_uint64);
+
+  printf("connections: %u, requests: %" PRIu64 ", errors: %" PRIu64 "\n",
+      config.connections, result.num_latencies + result.errors, result.errors);
+  if (result.num_latencies > 0) {
+    printf("elapsed: %.3fs, throughput: %.0f successful requests/s\n",
+        elapsed_ns / 1e9, result.num_latencies / (elapsed_ns / 1e9));
+    printf("latency: p50 %.1fus, p90 %.1fus, p99 %.1fus, p999 %.1fus, max %.1fus\n",
+        percentile(&result, 50) / 1000.0,
+        percentile(&result, 90) / 1000.0,
+        percentile(&result, 99) / 1000.0,
+        percentile(&result, 99.9) / 1000.0,
+        result.latencies_ns[result.num_latencies - 1] / 1000.0);
+  }
+
+  int status = EXIT_SUCCESS;
+  if (result.errors > 0) {
+    printf("Error: %" PRIu64 " of %" PRIu64 " requests failed; the figures above cover successful requests only.\n",
+        result.errors, result.num_latencies + result.errors);
+    status = EXIT_FAILURE;
+  }
+
+  for (uint32_t i = 0; i < config.connections; i++) {
+    free(clients[i].response);
+  }
+  free(clients);
+  free(result.latencies_ns);
+  close(epoll_fd);
+  exit(status);
+}
@@ -1,11 +1,13 @@
+require 'socket'
+
 describe 'database' do
   before do
     `rm -f test.db`
   end
 
-  def run_script(commands)
+  def run_script_raw(commands, options = '')
     raw_output = nil
-    IO.popen("./db test.db", "r+") do |pipe|
+    IO.popen("./db #{options} test.db", "r+b") do |pipe|
       commands.each do |cmd|
         pipe.puts cmd
       end
@@ -14,7 +16,11 @@ describe 'database' do
 
       raw_output = pipe.gets(nil)
     end
-    raw_output.split("\n")
+    raw_output
+  end
+
+  def run_script(commands, options = '')
+    run_script_raw(commands, options).split("\n")
   end
 
   it 'inserts and retrieves a row' do
@@ -116,11 +122,11 @@ describe 'database' do
     ])
     expect(result).to match_array([
       'db > Constants:',
-      'ROW_SIZE: 293',
+      'ROW_SIZE: 297',
       'COMMON_NODE_HEADER_SIZE: 6',
-      'LEAF_NODE_HEADER_SIZE: 10',
-      'LEAF_NODE_CELL_SIZE: 297',
-      'LEAF_NODE_SPACE_FOR_CELLS: 4086',
+      'LEAF_NODE_HEADER_SIZE: 14',
+      'LEAF_NODE_CELL_SIZE: 305',
+      'LEAF_NODE_SPACE_FOR_CELLS: 4082',
       'LEAF_NODE_MAX_CELLS: 13',
       'db > ',
     ])
@@ -173,6 +179,40 @@ describe 'database' do
 
     result = run_script(script)
 
+    expect(result[14...(result.length)]).to match_array([
+      'db > Tree:',
+      '- internal (size 1)',
+      "\t- leaf (size 13)",
+      "\t\t- 1",
+      "\t\t- 2",
+      "\t\t- 3",
+      "\t\t- 4",
+      "\t\t- 5",
+      "\t\t- 6",
+      "\t\t- 7",
+      "\t\t- 8",
+      "\t\t- 9",
+      "\t\t- 10",
+      "\t\t- 11",
+      "\t\t- 12",
+      "\t\t- 13",
+      "\t- key 13",
+      "\t- leaf (size 1)",
+      "\t\t- 14",
+      'db > Executed.',
+      'db > ',
+    ])
+  end
+
+  it 'splits a leaf in half when the new key is not an append' do
+    script = 14.downto(1).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << '.btree'
+    script << '.exit'
+
+    result = run_script(script)
+
     expect(result[14...(result.length)]).to match_array([
       'db > Tree:',
       '- internal (size 1)',
@@ -193,7 +233,434 @@ describe 'database' do
       "\t\t- 12",
       "\t\t- 13",
       "\t\t- 14",
-      'db > Need to implement searching an internal node'
+      'db > ',
+    ])
+  end
+
+  it 'prints all rows in a multi-level tree' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << 'select'
+    script << '.exit'
+    result = run_script(script)
+
+    expect(result[30...(result.length)]).to match_array(
+      ['db > (1, user1, person1@example.com)'] +
+      (2..30).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" } +
+      ['Executed.', 'db > ']
+    )
+  end
+
+  it 'finds keys in every leaf of a multi-level tree' do
+    script = (1..40).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << 'insert 5 user5 person5@example.com'
+    script << 'insert 27 user27 person27@example.com'
+    script << 'insert 40 user40 person40@example.com'
+    script << '.btree'
+    script << '.exit'
+    result = run_script(script)
+
+    expect(result[40, 3]).to eq([
+      'db > Error: Duplicate key.',
+      'db > Error: Duplicate key.',
+      'db > Error: Duplicate key.',
+    ])
+    expect(result.grep(/- key/)).to eq([
+      "\t- key 13",
+      "\t- key 26",
+      "\t- key 39",
+    ])
+  end
+
+  it 'splits full leaves that are not the rightmost leaf' do
+    ids = (1..30).map { |i| i * 10 }
+    script = ids.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << 'insert 5 user5 person5@example.com'
+    script << 'insert 135 user135 person135@example.com'
+    script << 'insert 135 user135 person135@example.com'
+    script << 'select'
+    script << '.btree'
+    script << '.exit'
+    result = run_script(script)
+
+    expect(result[30, 3]).to eq([
+      'db > Executed.',
+      'db > Executed.',
+      'db > Error: Duplicate key.',
+    ])
+    expect(result.join("\n").scan(/\((\d+), user/).flatten.map(&:to_i)).to eq((ids + [5, 135]).sort)
+    expect(result.grep(/- key/)).to eq([
+      "\t- key 60",
+      "\t- key 130",
+      "\t- key 190",
+      "\t- key 260",
+    ])
+  end
+
+  it 'reports per-statement counters through .stats' do
+    script = (1..3).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << 'select'
+    script << '.stats'
+    script << '.exit'
+    result = run_script(script)
+
+    expect(result).to include('db > Stats:')
+    expect(result).to include('btree.leaf_splits: 0')
+    expect(result.grep(/^statement\.insert: count 3, mean .*, p99 .*, max .*us$/).length).to eq(1)
+    expect(result.grep(/^statement\.select: count 1, /).length).to eq(1)
+  end
+
+  it 'clears counters with .stats reset' do
+    result = run_script([
+      'insert 1 user1 person1@example.com',
+      '.stats reset',
+      '.stats',
+      '.exit',
+    ])
+
+    expect(result).to include('db > Stats reset.')
+    expect(result).to include('pager.cache_hits: 0')
+    expect(result).to include('statement.insert: count 0')
+  end
+
+  it 'dumps stats periodically while the session is idle' do
+    `rm -f test.stats`
+    IO.popen('./db test.db', 'r+b') do |pipe|
+      pipe.puts 'insert 1 user1 person1@example.com'
+      pipe.puts '.stats dump test.stats 1'
+      pipe.flush
+      sleep 2.5
+      pipe.puts '.exit'
+      pipe.close_write
+      pipe.read
+    end
+
+    dump = File.read('test.stats').split("\n")
+    expect(dump.grep(/^--- \d+$/).length >= 2).to eq(true)
+    expect(dump.grep(/^pager\.io_engine: /).length >= 2).to eq(true)
+    expect(dump.grep(/^statement\.insert: count 1, /).length >= 2).to eq(true)
+    `rm -f test.stats`
+  end
+
+  it 'analyzes the shape and space utilization of the btree' do
+    script = (1..14).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << '.analyze'
+    script << '.exit'
+    result = run_script(script)
+
+    expect(result[14...(result.length)]).to match_array([
+      'db > Analysis:',
+      'height: 2',
+      'level 0: 1 nodes',
+      'level 1: 2 nodes',
+      'leaf nodes: 2, cells: 14, avg fill: 53.8%, min fill: 7.7% (of 13 cells)',
+      'internal nodes: 1, avg fan-out: 2.0, min fan-out: 2, max fan-out: 2',
+      'free space: 7964 bytes (64.8% of 3 tree pages), unreachable pages: 0',
+      'leaf page order: 1 of 1 transitions out of order, mean jump 2.0 pages',
+      'db > ',
+    ])
+  end
+
+  it 'assigns ids to rows inserted without one' do
+    result1 = run_script([
+      'insert into users (username, email) values (user1, person1@example.com)',
+      'insert 10 user10 person10@example.com',
+      'insert into users (username, email) values (user11, person11@example.com)',
+      '.exit',
+    ])
+    expect(result1).to match_array([
+      'db > Executed.',
+      'db > Executed.',
+      'db > Executed.',
+      'db > ',
+    ])
+
+    result2 = run_script([
+      'insert into users (username, email) values (user12, person12@example.com)',
+      'select',
+      '.exit',
+    ])
+    expect(result2).to match_array([
+      'db > Executed.',
+      'db > (1, user1, person1@example.com)',
+      '(10, user10, person10@example.com)',
+      '(11, user11, person11@example.com)',
+      '(12, user12, person12@example.com)',
+      'Executed.',
+      'db > ',
+    ])
+  end
+
+  it 'allows ids larger than 32 bits' do
+    result = run_script([
+      'insert 5000000000 user1 person1@example.com',
+      'insert 18446744073709551616 user2 person2@example.com',
+      'select',
+      '.exit',
+    ])
+    expect(result).to match_array([
+      'db > Executed.',
+      "db > Syntax error. Could not parse statement 'insert'.",
+      'db > (5000000000, user1, person1@example.com)',
+      'Executed.',
+      'db > ',
+    ])
+  end
+
+  it 'reports exhausted row ids separately from a full table' do
+    result = run_script([
+      'insert 18446744073709551615 user1 person1@example.com',
+      'insert into users (username, email) values (user2, person2@example.com)',
+      'insert 2 user2 person2@example.com',
+      '.exit',
+    ])
+    expect(result).to eq([
+      'db > Executed.',
+      'db > Error: No row ids left to assign. Insert with an explicit id.',
+      'db > Executed.',
+      'db > ',
+    ])
+  end
+
+  {
+    '--io=uring' => 'pager.io_engine: io_uring',
+    '--io=threads' => 'pager.io_engine: threads',
+    '--direct-io' => 'pager.direct_io: on',
+  }.each do |options, expected_stat|
+    it "reads back a multi-level tree written with #{options}" do
+      stats = run_script(['.stats', '.exit'], options)
+      unless stats.include?(expected_stat)
+        skip "#{options} is not available here (.stats does not report '#{expected_stat}')"
+      end
+
+      script = (1..100).map do |i|
+        "insert #{i} user#{i} person#{i}@example.com"
+      end
+      script << '.exit'
+      run_script(script, options)
+
+      result = run_script([
+        'select',
+        '.exit',
+      ], options)
+      expect(result).to match_array(
+        ['db > (1, user1, person1@example.com)'] +
+        (2..100).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" } +
+        ['Executed.', 'db > ']
+      )
+    end
+  end
+
+  ['--io=uring', '--io=threads'].each do |options|
+    it "fails loudly when a page write is cut short with #{options}" do
+      script = (1..20).map { |i| "insert #{i} user#{i} person#{i}@example.com" } + ['.exit']
+      # A 10 KiB file size limit cuts the write of page 2 off halfway
+      output = IO.popen(['bash', '-c', "trap '' XFSZ; ulimit -f 10; exec ./db #{options} test.db"], 'r+') do |pipe|
+        pipe.puts script
+        pipe.close_write
+        pipe.read
+      end
+      expect($?.exitstatus).to eq(1)
+      expect(output.split("\n").last).to match(/^db > Error: I\/O on page 2 /)
+    end
+  end
+
+  it 'serves statements to several clients over a unix domain socket' do
+    `rm -f test.sock`
+    server = IO.popen(['./db', '--serve', 'test.sock', 'test.db'])
+    expect(server.gets).to eq("Listening on test.sock\n")
+
+    request = lambda do |socket, statement|
+      socket.write([statement.bytesize].pack('N') + statement)
+      length = socket.read(4).unpack1('N')
+      response = socket.read(length)
+      [response.getbyte(0), response[1..-1]]
+    end
+
+    client1 = UNIXSocket.new('test.sock')
+    client2 = UNIXSocket.new('test.sock')
+    expect(request.call(client1, 'insert into users (username, email) values (user1, person1@example.com)')).to eq([0, "Executed.\n"])
+    expect(request.call(client2, 'insert into users (username, email) values (user2, person2@example.com)')).to eq([0, "Executed.\n"])
+    expect(request.call(client1, 'insert 2 user2 person2@example.com')).to eq([1, "Error: Duplicate key.\n"])
+    expect(request.call(client2, 'select')).to eq([0, "(1, user1, person1@example.com)\n(2, user2, person2@example.com)\nExecuted.\n"])
+    expect(request.call(client1, '.mode csv')).to eq([0, ''])
+    expect(request.call(client1, 'select')).to eq([0, "1,user1,person1@example.com\n2,user2,person2@example.com\nExecuted.\n"])
+    expect(request.call(client2, '.btree')).to eq([1, "Error: '.btree' is only available in the REPL.\n"])
+    expect(request.call(client2, '.bogus')).to eq([1, "Unrecognized command: '.bogus'.\n"])
+    stats = request.call(client2, '.stats')
+    expect(stats[0]).to eq(0)
+    expect(stats[1]).to include("statement.insert: count 3, ")
+    expect(request.call(client1, '.analyze')[1]).to include("leaf nodes: 1, cells: 2, ")
+    client1.close
+    client2.close
+
+    Process.kill('TERM', server.pid)
+    server.close
+
+    result = run_script([
+      'select',
+      '.exit',
+    ])
+    expect(result).to match_array([
+      'db > (1, user1, person1@example.com)',
+      '(2, user2, person2@example.com)',
+      'Executed.',
+      'db > ',
+    ])
+  end
+
+  it 'stops reading from a client that does not read its responses' do
+    `rm -f test.sock`
+    server = IO.popen(['./db', '--serve', 'test.sock', 'test.db'])
+    expect(server.gets).to eq("Listening on test.sock\n")
+
+    begin
+      statements = (1..1200).map { |i| "insert #{i} user#{i} person#{i}@example.com" } + ['select'] * 1000
+      client = UNIXSocket.new('test.sock')
+      writer = Thread.new do
+        statements.each { |statement| client.write([statement.bytesize].pack('N') + statement) }
+      end
+
+      # Unread, the selects would queue about 50 MB of responses in the server
+      sleep 1
+      rss_kb = File.read("/proc/#{server.pid}/status")[/^VmRSS:\s+(\d+)/, 1].to_i
+      expect(rss_kb < 16 * 1024).to eq(true)
+
+      responses = statements.map do
+        length = client.read(4).unpack1('N')
+        client.read(length)
+      end
+      writer.join
+      expect(responses.count { |response| response.getbyte(0) == 0 }).to eq(statements.length)
+      expect(responses.last.lines.length).to eq(1201)
+      client.close
+    ensure
+      Process.kill('TERM', server.pid)
+      server.close
+    end
+  end
+
+  it 'sheds connections instead of spinning at the file descriptor limit' do
+    `rm -f test.sock`
+    server = IO.popen(['bash', '-c', 'ulimit -n 16; exec ./db --serve test.sock test.db'])
+    expect(server.gets).to eq("Listening on test.sock\n")
+
+    begin
+      cpu_ticks = lambda do
+        File.read("/proc/#{server.pid}/stat").split(')').last.split[11, 2].map(&:to_i).sum
+      end
+
+      clients = (1..20).map { UNIXSocket.new('test.sock') }
+      sleep 0.2
+      ticks_before = cpu_ticks.call
+      sleep 1
+      expect(cpu_ticks.call - ticks_before < 20).to eq(true)
+
+      # Connections past the limit were closed; the rest are still served
+      served = clients.count do |client|
+        begin
+          client.write([6].pack('N') + 'select')
+          client.read(4)
+        rescue Errno::EPIPE, Errno::ECONNRESET
+          nil
+        end
+      end
+      expect(served > 0 && served < 20).to eq(true)
+      clients.each(&:close)
+    ensure
+      Process.kill('TERM', server.pid)
+      server.close
+    end
+  end
+
+  it 'flushes the table on SIGTERM while serving with the thread engine' do
+    `rm -f test.sock`
+    server = IO.popen(['./db', '--io=threads', '--serve', 'test.sock', 'test.db'])
+    expect(server.gets).to eq("Listening on test.sock\n")
+
+    client = UNIXSocket.new('test.sock')
+    statement = 'insert 1 user1 person1@example.com'
+    client.write([statement.bytesize].pack('N') + statement)
+    length = client.read(4).unpack1('N')
+    expect(client.read(length)).to eq("\x00Executed.\n".b)
+    client.close
+
+    Process.kill('TERM', server.pid)
+    server.close
+    expect($?.exitstatus).to eq(0)
+    expect(File.exist?('test.sock')).to eq(false)
+
+    result = run_script([
+      'select',
+      '.exit',
+    ])
+    expect(result).to match_array([
+      'db > (1, user1, person1@example.com)',
+      'Executed.',
+      'db > ',
+    ])
+  end
+
+  it 'prints rows as csv and tsv' do
+    result = run_script([
+      'insert 1 user1 person1@example.com',
+      'insert 2 user,2 "person2"@example.com',
+      '.mode csv',
+      'select',
+      '.mode tsv',
+      'select',
+      '.mode',
+      '.exit',
+    ])
+    expect(result).to match_array([
+      'db > Executed.',
+      'db > Executed.',
+      'db > db > 1,user1,person1@example.com',
+      '2,"user,2","""person2""@example.com"',
+      'Executed.',
+      "db > db > 1\tuser1\tperson1@example.com",
+      "2\tuser,2\t\"person2\"@example.com",
+      'Executed.',
+      'db > tsv',
+      'db > ',
+    ])
+  end
+
+  it 'streams rows in binary mode' do
+    output = run_script_raw([
+      'insert 1 user1 person1@example.com',
+      'insert 5000000000 user2 person2@example.com',
+      '.mode binary',
+      'select',
+      '.exit',
+    ])
+
+    prefix = 'db > Executed.' + "\n" + 'db > Executed.' + "\n" + 'db > db > '
+    expect(output[0, prefix.length]).to eq(prefix)
+    rows = []
+    offset = prefix.length
+    loop do
+      length = output[offset, 4].unpack1('N')
+      offset += 4
+      break if length == 0
+      expect(length).to eq(297)
+      row = output[offset, length]
+      rows << [row[0, 8].unpack1('Q<'), row[8, 33].unpack1('Z*'), row[41, 256].unpack1('Z*')]
+      offset += length
+    end
+    expect(rows).to eq([
+      [1, 'user1', 'person1@example.com'],
+      [5000000000, 'user2', 'person2@example.com'],
     ])
+    expect(output[offset..-1]).to eq("Executed.\ndb > ")
   end
 end